@@ -0,0 +1,136 @@
+/**
+ * @file append.c
+ *
+ * Append fast path implementation.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "append.h"
+#include "blocks.h"
+#include "dedup.h"
+#include "inode.h"
+
+typedef struct append_state {
+  int valid;
+  int tail_fbnum; // which block of the file the tail is
+  int tail_bnum;  // and where it lives
+  int resv_next;  // next reserved block
+  int resv_count; // reserved blocks left
+} append_state_t;
+
+static append_state_t append_state[INODE_COUNT];
+
+// Take the next reserved block for the file, reserving another run right
+// after goal when there is none left. Returns -1 if the disk is full.
+static int next_block(append_state_t *as, int goal)
+{
+  while (1)
+  {
+    if (as->resv_count == 0)
+    {
+      as->resv_next = reserve_blocks(goal, APPEND_PREALLOC, &as->resv_count);
+      if (as->resv_next == -1)
+      {
+        as->resv_count = 0;
+        // everything left is reserved by other files
+        return alloc_block_near(goal);
+      }
+    }
+    int bnum = as->resv_next++;
+    as->resv_count--;
+    if (claim_reserved_block(bnum) == 0)
+    {
+      return bnum;
+    }
+    // taken back by an allocation that found nothing else free; the rest of
+    // the run likely went the same way
+    unreserve_blocks(as->resv_next, as->resv_count);
+    as->resv_count = 0;
+  }
+}
+
+// Append data to the end of a file.
+int append_write(int inum, const char *buf, size_t size)
+{
+  append_state_t *as = &append_state[inum];
+  inode_t *inode = get_inode(inum);
+  size_t done = 0;
+
+  while (done < size)
+  {
+    int fbnum = inode->size / BLOCK_SIZE;
+    int pos = inode->size % BLOCK_SIZE;
+    if (pos == 0 && size - done >= BLOCK_SIZE &&
+        dedup_write(inode, fbnum, buf + done))
+    { // the same bytes are already stored
+      inode->size += BLOCK_SIZE;
+      done += BLOCK_SIZE;
+      continue;
+    }
+    if (!as->valid || as->tail_fbnum != fbnum)
+    {
+      // moved on to a new block; it may already be there (the first one
+      // usually is, others may have been preallocated), otherwise the file
+      // grows into a reserved one
+      int bnum = inode_get_bnum(inode, fbnum);
+      if (bnum != 0)
+      {
+        bnum = inode_write_bnum(inode, fbnum);
+        if (bnum == -1)
+        { // a shared block could not be copied
+          break;
+        }
+      }
+      else
+      {
+        int prev = fbnum > 0 ? inode_get_bnum(inode, fbnum - 1) : 0;
+        bnum = fbnum < INODE_MAX_BLOCKS ? next_block(as, prev + 1) : -1;
+        if (bnum == -1)
+        {
+          break;
+        }
+        if (inode_set_bnum(inode, fbnum, bnum) == -1)
+        {
+          free_block(bnum);
+          break;
+        }
+        // a fresh block holds whatever it did before; the file may have
+        // grown past its start with a hole, which must read as zeros
+        memset(blocks_get_block(bnum), 0, pos);
+      }
+      as->valid = 1;
+      as->tail_fbnum = fbnum;
+      as->tail_bnum = bnum;
+    }
+
+    size_t count = size - done < BLOCK_SIZE - pos ? size - done : BLOCK_SIZE - pos;
+    memcpy((char *)blocks_get_block(as->tail_bnum) + pos, buf + done, count);
+    blocks_mark_dirty(as->tail_bnum);
+    inode->size += count;
+    done += count;
+    if (pos + count == BLOCK_SIZE)
+    {
+      dedup_block(inode, fbnum);
+    }
+  }
+
+  blocks_mark_dirty(INODE_BLOCK);
+  printf("+ append_write(%d, %zu) -> %zu\n", inum, size, done);
+  if (done == 0 && size > 0)
+  {
+    return -1;
+  }
+  return done;
+}
+
+// Forget a file's tail and give back its reserved blocks.
+void append_forget(int inum)
+{
+  append_state_t *as = &append_state[inum];
+  if (as->resv_count > 0)
+  {
+    unreserve_blocks(as->resv_next, as->resv_count);
+  }
+  memset(as, 0, sizeof(append_state_t));
+}
@@ -0,0 +1,44 @@
+/**
+ * @file append.h
+ *
+ * Fast path for appending to a file.
+ *
+ * Most writes are appends to log files. For each file being appended to we
+ * remember where its tail block lives, so an append that fits there is a
+ * plain copy, and we keep a run of blocks reserved right after it, so when
+ * the file grows into a new block that block is next to the previous one and
+ * is claimed without searching the bitmap.
+ *
+ * As with delayed allocation the reserved blocks are not marked in use until
+ * the file actually grows into them, so a crash cannot leak them, and the
+ * unused ones are given back when the file is closed.
+ */
+#ifndef APPEND_H
+#define APPEND_H
+
+#include <stddef.h>
+
+#define APPEND_PREALLOC 16 // blocks reserved at a time for a growing file
+
+/**
+ * Append data to the end of a file.
+ *
+ * @param inum The inode number.
+ * @param buf Data to append.
+ * @param size Number of bytes to append.
+ *
+ * @return Number of bytes appended, which is less than size if the disk
+ * filled up, or -1 if nothing could be appended.
+ */
+int append_write(int inum, const char *buf, size_t size);
+
+/**
+ * Drop what is remembered about a file's tail and give back its reserved
+ * blocks. Must be called whenever the file's blocks are remapped or freed
+ * other than by appending.
+ *
+ * @param inum The inode number.
+ */
+void append_forget(int inum);
+
+#endif
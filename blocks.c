@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -18,9 +19,35 @@
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "csum.h"
+#include "dedup.h"
+#include "super.h"
+#include "uring.h"
 
-static int blocks_fd = -1;
+static int blocks_ndevs = 0;
+static int blocks_fds[BLOCKS_MAX_DEVICES];
+static void *blocks_maps[BLOCKS_MAX_DEVICES];
+static size_t blocks_map_size = 0; // per device, for BLOCKS_MAX_COUNT blocks
+static int blocks_unit = 1;
+static int blocks_nblocks = 0;
 static void *blocks_base = 0;
+static int blocks_flags = 0;
+
+// uring backend: which blocks have been read in, and which need writing back
+static uint8_t blocks_resident[BLOCK_BITMAP_SIZE];
+static uint8_t blocks_dirty[BLOCK_BITMAP_SIZE];
+
+// free blocks set aside for a growing file; in memory only, so nothing is
+// lost if we crash before the file grows into them
+static uint8_t blocks_reserved[BLOCK_BITMAP_SIZE];
+
+// BLOCKS_DISCARD: blocks freed since the last sync, and blocks whose freeing
+// has been written back so their storage can be handed back to the host
+static uint8_t discard_pending[BLOCK_BITMAP_SIZE];
+static uint8_t discard_ready[BLOCK_BITMAP_SIZE];
+
+// generation to stamp the groups of written blocks with, 0 while not tracking
+static u_int32_t blocks_generation = 0;
 
 // GSf blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes)
@@ -37,36 +64,510 @@ int bytes_to_blocks(int bytes)
   }
 }
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path)
+// Find the device holding the given block and the block's offset on it.
+// Stripe units are dealt out to the devices round-robin.
+static void blocks_locate(int bnum, int *dev, off_t *off)
 {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  fprintf(stderr, "+ blocks_init(%s) -> %d\n", image_path, blocks_fd);
-  assert(blocks_fd != -1);
+  int stripe = bnum / blocks_unit;
+  *dev = stripe % blocks_ndevs;
+  *off = ((off_t)(stripe / blocks_ndevs) * blocks_unit + bnum % blocks_unit) *
+         BLOCK_SIZE;
+}
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
-  assert(rv == 0);
+// Bytes each device needs to hold its share of the given number of blocks:
+// it holds every ndevs'th stripe unit, rounded up to whole units.
+static size_t blocks_dev_size(int count)
+{
+  int stripes = (count + blocks_unit - 1) / blocks_unit;
+  int dev_stripes = (stripes + blocks_ndevs - 1) / blocks_ndevs;
+  return (size_t)dev_stripes * blocks_unit * BLOCK_SIZE;
+}
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-  assert(blocks_base != MAP_FAILED);
+// Load and initialize the given disk image(s).
+void blocks_init(const char *image_path, int stripe_unit, int flags)
+{
+  if (flags & BLOCKS_RDONLY)
+  {
+    // a shared mapping of the files is what lets readers share the cache
+    flags &= ~(BLOCKS_URING | BLOCKS_DISCARD);
+  }
+  char *paths = strdup(image_path);
+  char *save = NULL;
+  blocks_ndevs = 0;
+  for (char *path = strtok_r(paths, ",", &save); path != NULL;
+       path = strtok_r(NULL, ",", &save))
+  {
+    assert(blocks_ndevs < BLOCKS_MAX_DEVICES);
+    int fd = open(path, flags & BLOCKS_RDONLY ? O_RDONLY : O_CREAT | O_RDWR,
+                  0644);
+    fprintf(stderr, "+ blocks_init(%s) -> %d\n", path, fd);
+    assert(fd != -1);
+    blocks_fds[blocks_ndevs++] = fd;
+  }
+  free(paths);
+  assert(blocks_ndevs > 0);
+  assert(stripe_unit > 0);
+
+  blocks_unit = stripe_unit;
+  blocks_nblocks = BLOCK_COUNT;
+  blocks_map_size = blocks_dev_size(BLOCKS_MAX_COUNT);
+  int rv;
+
+  blocks_flags = flags;
+  memset(blocks_resident, 0, sizeof(blocks_resident));
+  memset(blocks_dirty, 0, sizeof(blocks_dirty));
+  memset(blocks_reserved, 0, sizeof(blocks_reserved));
+  memset(discard_pending, 0, sizeof(discard_pending));
+  memset(discard_ready, 0, sizeof(discard_ready));
+  blocks_generation = 0;
+
+  // address space is set aside for the largest image up front, so growing
+  // never moves blocks around in memory
+  if (blocks_flags & BLOCKS_URING)
+  {
+    // an anonymous buffer the kernel transfers blocks in and out of
+    blocks_base = mmap(0, (size_t)BLOCKS_MAX_COUNT * BLOCK_SIZE,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(blocks_base != MAP_FAILED);
+    if (blocks_flags & BLOCKS_HOT_META)
+    {
+      // best effort; needs transparent huge pages enabled for madvise
+      madvise(blocks_base, (size_t)BLOCKS_MAX_COUNT * BLOCK_SIZE,
+              MADV_HUGEPAGE);
+    }
+    rv = uring_init(blocks_fds, blocks_ndevs, blocks_base,
+                    (size_t)BLOCK_COUNT * BLOCK_SIZE);
+    assert(rv == 0);
+  }
+  else
+  {
+    // map the images to memory; the part past the end of the files is
+    // never touched until they have been grown to cover it. Read-only
+    // images are mapped privately, so changes never reach the files
+    int map_flags = blocks_flags & BLOCKS_RDONLY ? MAP_PRIVATE : MAP_SHARED;
+    for (int dev = 0; dev < blocks_ndevs; dev++)
+    {
+      blocks_maps[dev] = mmap(0, blocks_map_size, PROT_READ | PROT_WRITE,
+                              map_flags, blocks_fds[dev], 0);
+      assert(blocks_maps[dev] != MAP_FAILED);
+    }
+  }
+
+  // make sure each disk image can hold its share of a new image; images are
+  // never shrunk, in case they were made with a different stripe unit.
+  // Growing a file leaves a hole, so new images start out sparse
+  rv = blocks_grow(BLOCK_COUNT);
+  assert(rv == 0);
 
   // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  if (!(blocks_flags & BLOCKS_RDONLY))
+  {
+    void *bbm = get_blocks_bitmap();
+    bitmap_put(bbm, 0, 1);
+    blocks_mark_dirty(0);
+  }
 }
 
-// Close the disk image.
+// Write back all dirty blocks and close the disk image(s).
 void blocks_free()
 {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  int rv = blocks_sync();
   assert(rv == 0);
+  if (blocks_flags & BLOCKS_URING)
+  {
+    uring_free();
+    rv = munmap(blocks_base, (size_t)BLOCKS_MAX_COUNT * BLOCK_SIZE);
+    assert(rv == 0);
+  }
+  for (int dev = 0; dev < blocks_ndevs; dev++)
+  {
+    if (!(blocks_flags & BLOCKS_URING))
+    {
+      rv = munmap(blocks_maps[dev], blocks_map_size);
+      assert(rv == 0);
+    }
+    close(blocks_fds[dev]);
+  }
+  blocks_ndevs = 0;
+}
+
+// Number of blocks in the image.
+int blocks_count() { return blocks_nblocks; }
+
+// Number of block groups, the last of which may be partial.
+int blocks_group_count()
+{
+  return (blocks_nblocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+}
+
+// Grow the image file(s) to hold the given number of blocks.
+int blocks_grow(int count)
+{
+  if (count < blocks_nblocks || count > BLOCKS_MAX_COUNT)
+  {
+    return -EINVAL;
+  }
+  size_t size = blocks_dev_size(count);
+  for (int dev = 0; dev < blocks_ndevs; dev++)
+  {
+    struct stat st;
+    if (fstat(blocks_fds[dev], &st) != 0)
+    {
+      return -errno;
+    }
+    if ((size_t)st.st_size >= size)
+    {
+      continue;
+    }
+    if (blocks_flags & BLOCKS_RDONLY)
+    {
+      return -EROFS;
+    }
+    if (ftruncate(blocks_fds[dev], size) != 0)
+    {
+      return -errno;
+    }
+  }
+  if ((blocks_flags & BLOCKS_URING) && count > blocks_nblocks)
+  {
+    int rv = uring_resize((size_t)count * BLOCK_SIZE);
+    if (rv != 0)
+    {
+      return rv;
+    }
+  }
+  fprintf(stderr, "+ blocks_grow(%d -> %d)\n", blocks_nblocks, count);
+  blocks_nblocks = count;
+  return 0;
 }
 
+// Number of image files the blocks are striped across.
+int blocks_device_count() { return blocks_ndevs; }
+
+// Number of consecutive blocks placed on one image.
+int blocks_stripe_unit() { return blocks_unit; }
+
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum)
+{
+  if (blocks_flags & BLOCKS_URING)
+  {
+    if (!bitmap_get(blocks_resident, bnum))
+    {
+      blocks_prefetch(&bnum, 1);
+    }
+    return blocks_base + BLOCK_SIZE * bnum;
+  }
+
+  int dev;
+  off_t off;
+  blocks_locate(bnum, &dev, &off);
+  return blocks_maps[dev] + off;
+}
+
+// Append a request for the given block, merging it into the previous request
+// when both are adjacent in memory and on the same device.
+// Returns the new number of requests.
+static int blocks_add_req(uring_req_t *reqs, int nreqs, uring_op_t op,
+                          int bnum)
+{
+  int dev;
+  off_t off;
+  blocks_locate(bnum, &dev, &off);
+
+  if (nreqs > 0)
+  {
+    uring_req_t *prev = &reqs[nreqs - 1];
+    if (prev->op == op && prev->file == dev &&
+        prev->file_off + (off_t)prev->len == off &&
+        prev->buf_off + prev->len == (size_t)bnum * BLOCK_SIZE)
+    {
+      prev->len += BLOCK_SIZE;
+      return nreqs;
+    }
+  }
+
+  reqs[nreqs].op = op;
+  reqs[nreqs].file = dev;
+  reqs[nreqs].buf_off = (size_t)bnum * BLOCK_SIZE;
+  reqs[nreqs].len = BLOCK_SIZE;
+  reqs[nreqs].file_off = off;
+  return nreqs + 1;
+}
+
+// Make sure the given blocks are in memory, reading the missing ones in one
+// batch.
+void blocks_prefetch(const int *bnums, int count)
+{
+  if (!(blocks_flags & BLOCKS_URING))
+  {
+    return;
+  }
+
+  static uring_req_t reqs[BLOCKS_MAX_COUNT];
+  int nreqs = 0;
+  for (int i = 0; i < count; i++)
+  {
+    int bnum = bnums[i];
+    if (bitmap_get(blocks_resident, bnum))
+    {
+      continue;
+    }
+    bitmap_put(blocks_resident, bnum, 1);
+    nreqs = blocks_add_req(reqs, nreqs, URING_READ, bnum);
+  }
+
+  if (nreqs > 0)
+  {
+    int rv = uring_submit(reqs, nreqs);
+    assert(rv == 0);
+  }
+}
+
+// Pass the given advice on for one run of mapped blocks.
+static void blocks_madvise(void *addr, size_t len, blocks_advice_t advice)
+{
+  switch (advice)
+  {
+  case BLOCKS_ADVISE_NORMAL:
+    madvise(addr, len, MADV_NORMAL);
+    break;
+  case BLOCKS_ADVISE_RANDOM:
+    madvise(addr, len, MADV_RANDOM);
+    break;
+  case BLOCKS_ADVISE_WILLNEED:
+    madvise(addr, len, MADV_WILLNEED);
+    break;
+  case BLOCKS_ADVISE_HOT:
+#ifdef MADV_POPULATE_WRITE
+    // fault the pages in now, writable unless that would copy them
+    if (madvise(addr, len,
+                blocks_flags & BLOCKS_RDONLY ? MADV_POPULATE_READ
+                                             : MADV_POPULATE_WRITE) == 0)
+    {
+      break;
+    }
+#endif
+    // older kernels can only be asked to read them in
+    madvise(addr, len, MADV_WILLNEED);
+    break;
+  }
+}
+
+// Tell the kernel how the given blocks are about to be used.
+void blocks_advise(const int *bnums, int count, blocks_advice_t advice)
+{
+  if (blocks_flags & BLOCKS_URING)
+  {
+    if (advice == BLOCKS_ADVISE_WILLNEED || advice == BLOCKS_ADVISE_HOT)
+    {
+      blocks_prefetch(bnums, count);
+    }
+    return;
+  }
+
+  char *start = NULL;
+  size_t len = 0;
+  for (int i = 0; i < count; i++)
+  {
+    char *addr = blocks_get_block(bnums[i]);
+    if (len > 0 && addr == start + len)
+    {
+      len += BLOCK_SIZE;
+      continue;
+    }
+    if (len > 0)
+    {
+      blocks_madvise(start, len, advice);
+    }
+    start = addr;
+    len = BLOCK_SIZE;
+  }
+  if (len > 0)
+  {
+    blocks_madvise(start, len, advice);
+  }
+}
+
+// Record that the given block was modified and must be written back.
+void blocks_mark_dirty(int bnum)
+{
+  bitmap_put(blocks_dirty, bnum, 1);
+  if (blocks_generation != 0)
+  {
+    u_int32_t *gen = &get_superblock()->group_gen[bnum / BLOCKS_PER_GROUP];
+    if (*gen != blocks_generation)
+    {
+      *gen = blocks_generation;
+      bitmap_put(blocks_dirty, 0, 1);
+    }
+  }
+}
+
+// Check whether a block was modified since it was last written back.
+int blocks_is_dirty(int bnum) { return bitmap_get(blocks_dirty, bnum); }
+
+// Stamp the groups of blocks marked dirty from now on with a generation.
+void blocks_track_changes(u_int32_t generation)
+{
+  blocks_generation = generation;
+}
+
+// The bitmap has been written back, so the blocks freed up to now can be
+// discarded without a crash bringing back files that used them.
+static void discard_sync()
+{
+  for (int ii = 0; ii < BLOCK_BITMAP_SIZE; ++ii)
+  {
+    discard_ready[ii] |= discard_pending[ii];
+    discard_pending[ii] = 0;
+  }
+}
+
+// Write back every dirty block, one request per run of adjacent blocks.
+int blocks_sync()
+{
+  static uring_req_t reqs[BLOCKS_MAX_COUNT + BLOCKS_MAX_DEVICES];
+  int nreqs = 0;
+  int rv = 0;
+
+  if (blocks_flags & BLOCKS_RDONLY)
+  {
+    memset(blocks_dirty, 0, sizeof(blocks_dirty));
+    return 0;
+  }
+
+  // first, as this dirties the checksum blocks
+  for (int ii = 0; ii < blocks_nblocks; ++ii)
+  {
+    if (bitmap_get(blocks_dirty, ii))
+    {
+      csum_update(ii);
+    }
+  }
+  for (int ii = 0; ii < blocks_nblocks; ++ii)
+  {
+    if (bitmap_get(blocks_dirty, ii))
+    {
+      bitmap_put(blocks_dirty, ii, 0);
+      nreqs = blocks_add_req(reqs, nreqs, URING_WRITE, ii);
+    }
+  }
+  if (nreqs == 0)
+  {
+    discard_sync();
+    return 0;
+  }
+
+  if (!(blocks_flags & BLOCKS_URING))
+  {
+    for (int i = 0; i < nreqs; i++)
+    {
+      if (msync(blocks_maps[reqs[i].file] + reqs[i].file_off, reqs[i].len,
+                MS_SYNC) != 0)
+      {
+        rv = -errno;
+      }
+    }
+  }
+  else
+  {
+    for (int dev = 0; dev < blocks_ndevs; dev++)
+    {
+      reqs[nreqs].op = URING_FSYNC;
+      reqs[nreqs].file = dev;
+      reqs[nreqs].len = 0;
+      nreqs++;
+    }
+    rv = uring_submit(reqs, nreqs);
+  }
+  if (rv == 0)
+  {
+    discard_sync();
+  }
+  return rv;
+}
+
+// Queue every free block for discarding, as fstrim would.
+void blocks_discard_all()
+{
+  void *bbm = get_blocks_bitmap();
+  for (int ii = 1; ii < blocks_nblocks; ++ii)
+  {
+    if (!bitmap_get(bbm, ii))
+    {
+      bitmap_put(discard_pending, ii, 1);
+    }
+  }
+}
+
+// Check whether any freed blocks are waiting for a sync before they can be
+// discarded.
+int blocks_discard_pending()
+{
+  for (int ii = 0; ii < BLOCK_BITMAP_SIZE; ++ii)
+  {
+    if (discard_pending[ii])
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Punch holes in the image(s) for up to max blocks freed before the last
+// sync, one request per run of adjacent blocks. Returns how many queued
+// blocks were dealt with.
+int blocks_discard(int max)
+{
+  static uring_req_t reqs[BLOCKS_MAX_COUNT];
+  void *bbm = get_blocks_bitmap();
+  int nreqs = 0;
+  int count = 0;
+
+  for (int ii = 1; ii < blocks_nblocks && count < max; ++ii)
+  {
+    if (!bitmap_get(discard_ready, ii))
+    {
+      continue;
+    }
+    bitmap_put(discard_ready, ii, 0);
+    count++;
+    if (bitmap_get(bbm, ii))
+    { // allocated again since
+      continue;
+    }
+    // its contents no longer matter, don't write them back
+    bitmap_put(blocks_dirty, ii, 0);
+    nreqs = blocks_add_req(reqs, nreqs, URING_DISCARD, ii);
+  }
+  if (nreqs == 0)
+  {
+    return count;
+  }
+
+  int rv = 0;
+  if (blocks_flags & BLOCKS_URING)
+  {
+    rv = uring_submit(reqs, nreqs);
+  }
+  else
+  {
+    for (int i = 0; i < nreqs; i++)
+    {
+      if (fallocate(blocks_fds[reqs[i].file],
+                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    reqs[i].file_off, reqs[i].len) != 0)
+      {
+        rv = -errno;
+      }
+    }
+  }
+  // not fatal, the host just keeps the space
+  printf("+ blocks_discard() -> %d blocks, %d runs (%d)\n", count, nreqs, rv);
+  return count;
+}
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
@@ -81,28 +582,149 @@ void *get_inode_bitmap()
   return (void *)(block + BLOCK_BITMAP_SIZE);
 }
 
-// Allocate a new block and return its index.
-int alloc_block()
+// Mark the given free block as allocated.
+static void take_block(int bnum)
+{
+  superblock_t *sb = get_superblock();
+  bitmap_put(get_blocks_bitmap(), bnum, 1);
+  bitmap_put(blocks_reserved, bnum, 0);
+  sb->group_free[bnum / BLOCKS_PER_GROUP]--;
+  sb->free_blocks--;
+  blocks_mark_dirty(0);
+}
+
+// Find the first free block at or after goal, wrapping around, and skipping
+// reserved blocks unless told otherwise. Returns -1 if there is none.
+static int find_free(int goal, int take_reserved)
 {
   void *bbm = get_blocks_bitmap();
+  superblock_t *sb = get_superblock();
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii)
+  for (int nn = 0; nn < blocks_nblocks;)
   {
-    if (!bitmap_get(bbm, ii))
+    int ii = (goal + nn) % blocks_nblocks;
+    // the per-group free counts let us skip full groups without scanning them
+    if (ii % BLOCKS_PER_GROUP == 0 && sb->group_free[ii / BLOCKS_PER_GROUP] == 0)
+    {
+      // to the end of the group; the last one may be partial
+      int end = ii + BLOCKS_PER_GROUP;
+      nn += (end < blocks_nblocks ? end : blocks_nblocks) - ii;
+      continue;
+    }
+    if (ii != 0 && !bitmap_get(bbm, ii) &&
+        (take_reserved || !bitmap_get(blocks_reserved, ii)))
     {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
       return ii;
     }
+    nn++;
+  }
+  return -1;
+}
+
+// Allocate a new block and return its index.
+int alloc_block() { return alloc_block_near(1); }
+
+// Allocate the first free block at or after goal and return its index.
+int alloc_block_near(int goal)
+{
+  int bnum = find_free(goal, 0);
+  if (bnum == -1)
+  {
+    // out of space otherwise; take back a block set aside for a file
+    bnum = find_free(goal, 1);
+  }
+  if (bnum != -1)
+  {
+    take_block(bnum);
+  }
+  printf("+ alloc_block_near(%d) -> %d\n", goal, bnum);
+  return bnum;
+}
+
+// Set aside up to max free blocks in a row, starting as close after goal as
+// possible. Returns the first one and stores how many in count.
+int reserve_blocks(int goal, int max, int *count)
+{
+  void *bbm = get_blocks_bitmap();
+  int first = find_free(goal, 0);
+  if (first == -1)
+  {
+    return -1;
   }
+  int nn = 0;
+  while (nn < max && first + nn < blocks_nblocks &&
+         !bitmap_get(bbm, first + nn) &&
+         !bitmap_get(blocks_reserved, first + nn))
+  {
+    bitmap_put(blocks_reserved, first + nn, 1);
+    nn++;
+  }
+  *count = nn;
+  printf("+ reserve_blocks(%d) -> %d +%d\n", goal, first, nn);
+  return first;
+}
 
+// Find the first run of count free blocks, passing over reserved ones.
+int blocks_find_run(int count)
+{
+  void *bbm = get_blocks_bitmap();
+  int len = 0;
+  for (int ii = 1; ii < blocks_nblocks; ++ii)
+  {
+    if (bitmap_get(bbm, ii) || bitmap_get(blocks_reserved, ii))
+    {
+      len = 0;
+    }
+    else if (++len == count)
+    {
+      return ii - count + 1;
+    }
+  }
   return -1;
 }
 
+// Give back reserved blocks that were not used.
+void unreserve_blocks(int first, int count)
+{
+  for (int ii = first; ii < first + count; ++ii)
+  {
+    bitmap_put(blocks_reserved, ii, 0);
+  }
+}
+
+// Allocate a block that was reserved, unless it has been taken meanwhile.
+int claim_reserved_block(int bnum)
+{
+  if (!bitmap_get(blocks_reserved, bnum) ||
+      bitmap_get(get_blocks_bitmap(), bnum))
+  {
+    return -1;
+  }
+  take_block(bnum);
+  return 0;
+}
+
 // Deallocate the block with the given index.
 void free_block(int bnum)
 {
+  if (dedup_release(bnum))
+  { // still named by another file
+    printf("+ free_block(%d) -> shared\n", bnum);
+    return;
+  }
   printf("+ free_block(%d)\n", bnum);
+  csum_clear(bnum);
   void *bbm = get_blocks_bitmap();
+  superblock_t *sb = get_superblock();
+  if (bitmap_get(bbm, bnum))
+  {
+    sb->group_free[bnum / BLOCKS_PER_GROUP]++;
+    sb->free_blocks++;
+    if (blocks_flags & BLOCKS_DISCARD)
+    {
+      bitmap_put(discard_pending, bnum, 1);
+    }
+  }
   bitmap_put(bbm, bnum, 0);
+  blocks_mark_dirty(0);
 }
@@ -5,15 +5,39 @@
  * A block-based abstraction over a disk image file.
  *
  * The disk image is mmapped, so block data is accessed using pointers.
+ *
+ * Block 0 holds the block bitmap, sized for the largest image, followed by
+ * the inode bitmap and the superblock.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
-#define BLOCK_COUNT 256
+#define BLOCK_COUNT 256 // blocks in a new image; it can be grown later
+#define BLOCKS_MAX_COUNT 8192 // most blocks an image can be grown to (32MB)
 #define BLOCK_SIZE 4096
-#define NUFS_SIZE  (BLOCK_SIZE * BLOCK_COUNT)
-#define BLOCK_BITMAP_SIZE (BLOCK_COUNT / 8)
+#define BLOCK_BITMAP_SIZE (BLOCKS_MAX_COUNT / 8)
+#define BLOCKS_PER_GROUP 64 // blocks covered by one free-space counter
+
+#define BLOCKS_MAX_DEVICES 8
+#define BLOCKS_STRIPE_UNIT 16 // default stripe unit, in blocks
+
+// blocks_init flags
+#define BLOCKS_URING 0x1 // keep the image in memory and do I/O with io_uring
+#define BLOCKS_DISCARD 0x2 // hand freed blocks back to the host
+#define BLOCKS_RDONLY 0x4 // never write to the image
+#define BLOCKS_HOT_META 0x8 // keep metadata in memory, see BLOCKS_ADVISE_HOT
+#define BLOCKS_DEDUP 0x10 // share identical data blocks, see dedup.h
+#define BLOCKS_VERIFY 0x20 // check blocks against their checksums, see csum.h
 
 #include <stdio.h>
+#include <sys/types.h>
+
+// what blocks_advise tells the kernel about blocks
+typedef enum blocks_advice {
+  BLOCKS_ADVISE_NORMAL,   // read around faults as usual
+  BLOCKS_ADVISE_RANDOM,   // read only the faulting block
+  BLOCKS_ADVISE_WILLNEED, // start reading them in now
+  BLOCKS_ADVISE_HOT,      // read them in and map them now
+} blocks_advice_t;
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -27,15 +51,159 @@ int bytes_to_blocks(int bytes);
 /**
  * Load and initialize the given disk image.
  *
- * @param image_path Path to the disk image file.
+ * By default the image is mmapped and the kernel pages blocks in and out.
+ * With BLOCKS_URING the image is instead kept in a registered buffer that is
+ * filled and written back in batches through io_uring.
+ *
+ * Several comma-separated image files can be given, in which case the blocks
+ * are striped across them RAID-0 style: consecutive runs of stripe_unit
+ * blocks go to each image in turn. The same list, in the same order, and the
+ * same stripe unit must be used on every mount.
+ *
+ * With BLOCKS_RDONLY the image is opened read-only and mapped copy-on-write,
+ * whatever the other flags say. Every process mapping it shares one copy in
+ * the page cache; blocks changed in memory get a private copy and are never
+ * written back. The image must already exist, at its full size.
+ *
+ * With BLOCKS_HOT_META the uring buffer is backed by huge pages where the
+ * kernel allows, to spare the TLB; see also BLOCKS_ADVISE_HOT.
+ *
+ * @param image_path Path to the disk image file, or a comma-separated list.
+ * @param stripe_unit Number of consecutive blocks placed on one image.
+ * @param flags Zero or more BLOCKS_* flags.
  */
-void blocks_init(const char *image_path);
+void blocks_init(const char *image_path, int stripe_unit, int flags);
 
 /**
- * Close the disk image.
+ * Write back all dirty blocks and close the disk image.
  */
 void blocks_free();
 
+/**
+ * Make sure the given blocks are in memory, reading the missing ones in a
+ * single batch. Adjacent block numbers are merged into one request.
+ *
+ * A no-op for the mmap backend.
+ *
+ * @param bnums Block numbers to load.
+ * @param count Number of block numbers.
+ */
+void blocks_prefetch(const int *bnums, int count);
+
+/**
+ * Tell the kernel how the given blocks are about to be used, with one
+ * madvise per run of blocks that are adjacent in memory.
+ *
+ * The uring backend reads the blocks in for BLOCKS_ADVISE_WILLNEED and
+ * BLOCKS_ADVISE_HOT, as blocks_prefetch, and ignores the rest.
+ *
+ * @param bnums Block numbers.
+ * @param count Number of block numbers.
+ * @param advice What to tell the kernel.
+ */
+void blocks_advise(const int *bnums, int count, blocks_advice_t advice);
+
+/**
+ * Record that the given block was modified and must be written back.
+ *
+ * @param bnum Block number (index).
+ */
+void blocks_mark_dirty(int bnum);
+
+/**
+ * Check whether a block was modified since it was last written back.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return 1 if it was, 0 if not.
+ */
+int blocks_is_dirty(int bnum);
+
+/**
+ * Stamp the group of every block marked dirty from now on with the given
+ * generation, in the superblock's group_gen.
+ *
+ * @param generation Generation to stamp, 0 to stop.
+ */
+void blocks_track_changes(u_int32_t generation);
+
+/**
+ * Write back every dirty block and wait for it to reach the disk.
+ *
+ * The checksums of the dirty blocks are brought up to date first (see
+ * csum.h), and runs of adjacent dirty blocks are written with a single
+ * request.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int blocks_sync();
+
+/**
+ * Queue every free block for discarding.
+ */
+void blocks_discard_all();
+
+/**
+ * Check whether blocks have been freed since the last sync. With
+ * BLOCKS_DISCARD they can only be discarded once a sync has written back the
+ * bitmap that says they are free.
+ *
+ * @return 1 if there are any, 0 if not.
+ */
+int blocks_discard_pending();
+
+/**
+ * Punch holes in the image file(s) where blocks were freed before the last
+ * sync, so the host can reclaim the space. Only does anything with
+ * BLOCKS_DISCARD. Blocks allocated again meanwhile are skipped.
+ *
+ * @param max Most blocks to deal with.
+ *
+ * @return Number of queued blocks dealt with.
+ */
+int blocks_discard(int max);
+
+/**
+ * Return the number of blocks in the image.
+ *
+ * @return Number of blocks, BLOCK_COUNT for a new image.
+ */
+int blocks_count();
+
+/**
+ * Return the number of block groups, the last of which may be partial.
+ *
+ * @return Number of groups of BLOCKS_PER_GROUP blocks.
+ */
+int blocks_group_count();
+
+/**
+ * Grow the image to the given number of blocks, extending the image files.
+ * Can be done while mounted: blocks keep their addresses, and pointers to
+ * blocks stay valid.
+ *
+ * The new blocks are not marked free; that is up to the superblock.
+ *
+ * @param count New number of blocks, at most BLOCKS_MAX_COUNT.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int blocks_grow(int count);
+
+/**
+ * Return the number of image files the blocks are striped across.
+ *
+ * @return Number of image files.
+ */
+int blocks_device_count();
+
+/**
+ * Return the stripe unit the image(s) were opened with.
+ *
+ * @return Number of consecutive blocks placed on one image.
+ */
+int blocks_stripe_unit();
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -62,14 +230,72 @@ void *get_inode_bitmap();
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the first unused block and marks it as allocated, skipping groups
+ * whose free count says they are full.
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
 /**
- * Deallocate the block with the given number.
+ * Allocate the first free block at or after the given one, wrapping around
+ * at the end of the disk. Allocating next to a file's previous block keeps
+ * the file contiguous.
+ *
+ * Reserved blocks are only handed out when there is nothing else left.
+ *
+ * @param goal Block number to start looking from.
+ *
+ * @return The index of the newly allocated block, or -1 if the disk is full.
+ */
+int alloc_block_near(int goal);
+
+/**
+ * Set aside a run of free blocks for a file that is growing, without marking
+ * them as allocated. Other allocations pass over reserved blocks for as long
+ * as there is anything else free.
+ *
+ * Reservations are kept in memory only.
+ *
+ * @param goal Block number to start looking from.
+ * @param max Most blocks to reserve.
+ * @param count Set to the number of blocks actually reserved, at least 1.
+ *
+ * @return The first block of the run, or -1 if the disk is full.
+ */
+int reserve_blocks(int goal, int max, int *count);
+
+/**
+ * Find the first run of free blocks of the given length, without allocating
+ * it. Reserved blocks are not counted as free.
+ *
+ * @param count Length of the run.
+ *
+ * @return The first block of the run, or -1 if there is none.
+ */
+int blocks_find_run(int count);
+
+/**
+ * Give back reserved blocks that were not used.
+ *
+ * @param first First block of the run.
+ * @param count Number of blocks in the run.
+ */
+void unreserve_blocks(int first, int count);
+
+/**
+ * Allocate a block that was set aside with reserve_blocks.
+ *
+ * @param bnum The reserved block number.
+ *
+ * @return 0 on success, -1 if the block was given to someone else because
+ * the disk filled up.
+ */
+int claim_reserved_block(int bnum);
+
+/**
+ * Deallocate the block with the given number. A data block other files
+ * share (see dedup.h) only loses a reference.
  *
  * @param bnun The block number to deallocate.
  */
@@ -0,0 +1,121 @@
+/**
+ * @file crc32c.c
+ *
+ * CRC-32C with the SSE4.2 crc32 instruction where the CPU has it, and
+ * table-driven slicing-by-8 everywhere else.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // reversed Castagnoli polynomial
+
+// crc32c_table[k][b]: remainder of byte b followed by k zero bytes
+static u_int32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static u_int32_t (*crc32c_update)(u_int32_t crc, const unsigned char *p,
+                                  size_t len);
+
+// One byte at a time.
+static u_int32_t crc32c_bytes(u_int32_t crc, const unsigned char *p,
+                              size_t len)
+{
+  for (size_t ii = 0; ii < len; ii++)
+  {
+    crc = crc32c_table[0][(crc ^ p[ii]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+// Eight bytes at a time, looking each one up in the table for its distance
+// from the end of the word.
+static u_int32_t crc32c_slice8(u_int32_t crc, const unsigned char *p,
+                               size_t len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    u_int32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+  }
+#endif
+  return crc32c_bytes(crc, p, len);
+}
+
+#ifdef CRC32C_X86
+// With the crc32 instruction, which computes exactly this polynomial.
+__attribute__((target("sse4.2"))) static u_int32_t
+crc32c_sse42(u_int32_t crc, const unsigned char *p, size_t len)
+{
+#ifdef __x86_64__
+  u_int64_t crc64 = crc;
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    u_int64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (u_int32_t)crc64;
+#endif
+  for (; len >= 4; p += 4, len -= 4)
+  {
+    u_int32_t word;
+    memcpy(&word, p, 4);
+    crc = _mm_crc32_u32(crc, word);
+  }
+  for (; len > 0; p++, len--)
+  {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+// Fill in the tables and pick the fastest implementation.
+static void crc32c_init()
+{
+  for (u_int32_t ii = 0; ii < 256; ii++)
+  {
+    u_int32_t crc = ii;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+    }
+    crc32c_table[0][ii] = crc;
+  }
+  for (int k = 1; k < 8; k++)
+  {
+    for (int ii = 0; ii < 256; ii++)
+    {
+      u_int32_t prev = crc32c_table[k - 1][ii];
+      crc32c_table[k][ii] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+    }
+  }
+  crc32c_update = crc32c_slice8;
+#ifdef CRC32C_X86
+  if (__builtin_cpu_supports("sse4.2"))
+  {
+    crc32c_update = crc32c_sse42;
+  }
+#endif
+}
+
+// Compute the CRC-32C of a buffer, or continue one.
+u_int32_t crc32c(u_int32_t crc, const void *buf, size_t len)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_update(~crc, buf, len);
+}
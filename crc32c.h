@@ -0,0 +1,23 @@
+/**
+ * @file crc32c.h
+ *
+ * CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs.
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Compute the CRC-32C of a buffer, or continue one.
+ *
+ * @param crc 0 to start, or the result for the data before buf.
+ * @param buf Data to checksum.
+ * @param len Length of the data in bytes.
+ *
+ * @return The CRC-32C of everything so far.
+ */
+u_int32_t crc32c(u_int32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,213 @@
+/**
+ * @file csum.c
+ *
+ * Block checksums, see csum.h.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "crc32c.h"
+#include "csum.h"
+#include "super.h"
+
+static int csum_active = 0;    // mounted: checksum blocks may be allocated
+static int csum_verifying = 0; // BLOCKS_VERIFY, and the checksums match
+// blocks that matched their checksum since they were last written back
+static u_int8_t csum_checked[BLOCK_BITMAP_SIZE];
+
+// Check whether a block has a checksum of its own: not block 0, which
+// holds the list of checksum blocks, and not one of those.
+static int csum_covered(int bnum)
+{
+  superblock_t *sb = get_superblock();
+  if (bnum == 0)
+  {
+    return 0;
+  }
+  for (int region = 0; region < CSUM_REGIONS; region++)
+  {
+    if (sb->csum_blocks[region] == (u_int32_t)bnum)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Where the checksum of a block is kept, NULL if its region has no
+// checksum block.
+static u_int32_t *csum_slot(int bnum)
+{
+  u_int32_t cbnum = get_superblock()->csum_blocks[bnum / CSUM_PER_BLOCK];
+  if (cbnum == 0)
+  {
+    return NULL;
+  }
+  return (u_int32_t *)blocks_get_block(cbnum) + bnum % CSUM_PER_BLOCK;
+}
+
+// Compute the checksums of all the allocated blocks of a region.
+static void csum_fill(int region)
+{
+  void *bbm = get_blocks_bitmap();
+  int first = region * CSUM_PER_BLOCK;
+  int last = first + CSUM_PER_BLOCK < blocks_count() ? first + CSUM_PER_BLOCK
+                                                     : blocks_count();
+  int bnums[CSUM_PER_BLOCK];
+  int count = 0;
+  for (int bnum = first; bnum < last; bnum++)
+  {
+    if (bitmap_get(bbm, bnum))
+    {
+      bnums[count++] = bnum;
+    }
+  }
+  blocks_advise(bnums, count, BLOCKS_ADVISE_WILLNEED);
+
+  u_int32_t cbnum = get_superblock()->csum_blocks[region];
+  u_int32_t *sums = blocks_get_block(cbnum);
+  for (int bnum = first; bnum < first + (int)CSUM_PER_BLOCK; bnum++)
+  {
+    sums[bnum - first] = bnum < last && bitmap_get(bbm, bnum) &&
+                                 csum_covered(bnum)
+                             ? csum_compute(blocks_get_block(bnum))
+                             : CSUM_NONE;
+  }
+  blocks_mark_dirty(cbnum);
+}
+
+// Give a region a checksum block near its start and fill it in. Returns 0,
+// or -1 if the disk is full.
+static int csum_add_region(int region)
+{
+  int cbnum = alloc_block_near(region == 0 ? 1 : region * CSUM_PER_BLOCK);
+  if (cbnum == -1)
+  {
+    return -1;
+  }
+  get_superblock()->csum_blocks[region] = cbnum;
+  blocks_mark_dirty(0);
+  csum_fill(region);
+  printf("+ csum_add_region(%d) -> %d\n", region, cbnum);
+  return 0;
+}
+
+// Start keeping checksums up to date.
+void csum_init(int trusted, int flags)
+{
+  superblock_t *sb = get_superblock();
+  memset(csum_checked, 0, sizeof(csum_checked));
+  if (flags & BLOCKS_RDONLY)
+  {
+    // nothing may be written, so only trusted checksums are any use
+    csum_active = 0;
+    csum_verifying = (flags & BLOCKS_VERIFY) && trusted && sb->csum_valid;
+    return;
+  }
+  csum_active = 1;
+  csum_verifying = flags & BLOCKS_VERIFY;
+  int recompute = !trusted || !sb->csum_valid;
+  for (int region = 0; region * CSUM_PER_BLOCK < blocks_count(); region++)
+  {
+    if (sb->csum_blocks[region] == 0)
+    {
+      csum_add_region(region);
+    }
+    else if (recompute)
+    {
+      csum_fill(region);
+    }
+  }
+  sb->csum_valid = 1;
+  blocks_mark_dirty(0);
+  if (recompute)
+  {
+    printf("+ csum_init() -> recomputed\n");
+  }
+}
+
+// Check whether the checksums on the image match its blocks.
+int csum_trusted()
+{
+  superblock_t *sb = get_superblock();
+  return sb->state == SUPER_CLEAN && sb->csum_valid;
+}
+
+// Compute the checksum of a block's contents.
+u_int32_t csum_compute(const void *data)
+{
+  u_int32_t crc = crc32c(0, data, BLOCK_SIZE);
+  // the one value taken to mean none is moved out of the way
+  return crc != CSUM_NONE ? crc : ~CSUM_NONE;
+}
+
+// Return the checksum stored for a block.
+u_int32_t csum_get(int bnum)
+{
+  u_int32_t *slot = csum_covered(bnum) ? csum_slot(bnum) : NULL;
+  return slot != NULL ? *slot : CSUM_NONE;
+}
+
+// Store the checksum of a block that is about to be written back.
+void csum_update(int bnum)
+{
+  superblock_t *sb = get_superblock();
+  if (sb->magic != SUPER_MAGIC || !sb->csum_valid || !csum_covered(bnum))
+  {
+    return;
+  }
+  bitmap_put(csum_checked, bnum, 0);
+  int region = bnum / CSUM_PER_BLOCK;
+  if (sb->csum_blocks[region] == 0)
+  {
+    // the image has grown into a new region; filling in its checksum
+    // block takes care of this one too
+    if (csum_active)
+    {
+      csum_add_region(region);
+    }
+    return;
+  }
+  *csum_slot(bnum) = csum_compute(blocks_get_block(bnum));
+  blocks_mark_dirty(sb->csum_blocks[region]);
+}
+
+// Forget the checksum of a block that is being freed.
+void csum_clear(int bnum)
+{
+  superblock_t *sb = get_superblock();
+  bitmap_put(csum_checked, bnum, 0);
+  if (sb->magic != SUPER_MAGIC || !sb->csum_valid || !csum_covered(bnum))
+  {
+    return;
+  }
+  u_int32_t *slot = csum_slot(bnum);
+  if (slot != NULL && *slot != CSUM_NONE)
+  {
+    *slot = CSUM_NONE;
+    blocks_mark_dirty(sb->csum_blocks[bnum / CSUM_PER_BLOCK]);
+  }
+}
+
+// Check a block that is about to be read against its checksum.
+int csum_verify(int bnum)
+{
+  if (!csum_verifying || bitmap_get(csum_checked, bnum) ||
+      blocks_is_dirty(bnum))
+  {
+    return 0;
+  }
+  u_int32_t sum = csum_get(bnum);
+  if (sum == CSUM_NONE)
+  {
+    return 0;
+  }
+  if (csum_compute(blocks_get_block(bnum)) != sum)
+  {
+    fprintf(stderr, "+ csum_verify(%d) -> mismatch\n", bnum);
+    return -1;
+  }
+  bitmap_put(csum_checked, bnum, 1);
+  return 0;
+}
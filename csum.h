@@ -0,0 +1,91 @@
+/**
+ * @file csum.h
+ *
+ * Block checksums.
+ *
+ * The CRC-32C of every block is kept in checksum blocks, each covering a
+ * region of CSUM_PER_BLOCK consecutive blocks and allocated near the start
+ * of it; the superblock lists them. The checksums of the dirty blocks are
+ * brought up to date by every sync, just before the blocks are written
+ * back, so they match the image whenever it was unmounted cleanly. After a
+ * crash they are recomputed at mount.
+ *
+ * CSUM_NONE stands for no checksum: free blocks, blocks not written since
+ * they were allocated, block 0 and the checksum blocks themselves.
+ */
+#ifndef CSUM_H
+#define CSUM_H
+
+#include <sys/types.h>
+
+#include "blocks.h"
+
+#define CSUM_PER_BLOCK (BLOCK_SIZE / 4) // checksums in a checksum block
+#define CSUM_REGIONS (BLOCKS_MAX_COUNT / CSUM_PER_BLOCK)
+#define CSUM_NONE 0
+
+/**
+ * Start keeping checksums up to date, giving every region that has none a
+ * checksum block, and recomputing them all unless they can be trusted.
+ * With BLOCKS_RDONLY nothing is changed, and the checksums are only used if
+ * they can be trusted as they are.
+ *
+ * @param trusted Whether the image was unmounted cleanly.
+ * @param flags The BLOCKS_* flags the image was opened with; with
+ * BLOCKS_VERIFY blocks are checked as they are read, see csum_verify.
+ */
+void csum_init(int trusted, int flags);
+
+/**
+ * Check whether the checksums on the image match its blocks: they have
+ * been computed, and the image was unmounted cleanly since.
+ *
+ * @return 1 if they can be trusted, 0 if not.
+ */
+int csum_trusted();
+
+/**
+ * Compute the checksum of a block's contents, never CSUM_NONE.
+ *
+ * @param data BLOCK_SIZE bytes.
+ *
+ * @return The checksum.
+ */
+u_int32_t csum_compute(const void *data);
+
+/**
+ * Return the checksum stored for a block.
+ *
+ * @param bnum Block number.
+ *
+ * @return The checksum, or CSUM_NONE if it has none.
+ */
+u_int32_t csum_get(int bnum);
+
+/**
+ * Store the checksum of a block that is about to be written back. Does
+ * nothing unless checksums are being kept.
+ *
+ * @param bnum Block number.
+ */
+void csum_update(int bnum);
+
+/**
+ * Forget the checksum of a block that is being freed.
+ *
+ * @param bnum Block number.
+ */
+void csum_clear(int bnum);
+
+/**
+ * With verification on, check a block that is about to be read against its
+ * checksum. Blocks changed since the last sync, and blocks without a
+ * checksum, pass; so does any block a second time.
+ *
+ * @param bnum Block number.
+ *
+ * @return 0 if it matches, -1 if it is damaged.
+ */
+int csum_verify(int bnum);
+
+#endif
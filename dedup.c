@@ -0,0 +1,214 @@
+/**
+ * @file dedup.c
+ *
+ * Implementation of block sharing and the fingerprint index.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "dedup.h"
+#include "xxh64.h"
+
+// pointers naming each block beyond the first
+static u_int32_t dedup_extra[BLOCKS_MAX_COUNT];
+
+// the index: fingerprints of indexed blocks, chained per bucket by block
+static int dedup_active = 0;
+static uint8_t dedup_indexed[BLOCK_BITMAP_SIZE];
+static u_int64_t dedup_fp[BLOCKS_MAX_COUNT];
+static int dedup_next[BLOCKS_MAX_COUNT];
+static int dedup_head[DEDUP_BUCKETS];
+static u_int64_t dedup_hits = 0; // blocks shared since mount
+
+// Add a block to the index under the given fingerprint.
+static void dedup_index(int bnum, u_int64_t fp)
+{
+  int bucket = fp % DEDUP_BUCKETS;
+  dedup_fp[bnum] = fp;
+  dedup_next[bnum] = dedup_head[bucket];
+  dedup_head[bucket] = bnum;
+  bitmap_put(dedup_indexed, bnum, 1);
+}
+
+// Find an indexed block holding the given bytes, or -1.
+static int dedup_lookup(const char *data, u_int64_t fp)
+{
+  for (int bnum = dedup_head[fp % DEDUP_BUCKETS]; bnum != -1;
+       bnum = dedup_next[bnum])
+  {
+    if (dedup_fp[bnum] == fp &&
+        memcmp(blocks_get_block(bnum), data, BLOCK_SIZE) == 0)
+    {
+      return bnum;
+    }
+  }
+  return -1;
+}
+
+// Count the pointers naming each data block, and fingerprint them if active.
+void dedup_init(int active)
+{
+  static uint8_t seen[BLOCK_BITMAP_SIZE];
+  void *ibm = get_inode_bitmap();
+  memset(dedup_extra, 0, sizeof(dedup_extra));
+  memset(dedup_indexed, 0, sizeof(dedup_indexed));
+  memset(dedup_head, -1, sizeof(dedup_head));
+  memset(seen, 0, sizeof(seen));
+  dedup_active = active;
+  dedup_hits = 0;
+
+  int indexed = 0;
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    inode_t *node = get_inode(inum);
+    if (!bitmap_get(ibm, inum) || node->mode == DIRECTORY_MODE)
+    {
+      continue;
+    }
+    int last = node->iblock != 0 ? INODE_MAX_BLOCKS : 1;
+    for (int fbnum = 0; fbnum < last; fbnum++)
+    {
+      int bnum = inode_get_bnum(node, fbnum);
+      if (bnum == 0)
+      {
+        continue;
+      }
+      if (bitmap_get(seen, bnum))
+      {
+        dedup_extra[bnum]++;
+        continue;
+      }
+      bitmap_put(seen, bnum, 1);
+      // only blocks the file fills; the end of the last one may change
+      if (active && (fbnum + 1) * (long)BLOCK_SIZE <= node->size &&
+          !inode_unwritten(node, fbnum))
+      {
+        dedup_index(bnum, xxh64(blocks_get_block(bnum), BLOCK_SIZE, 0));
+        indexed++;
+      }
+    }
+  }
+  fprintf(stderr, "+ dedup_init(%d) -> %d blocks indexed\n", active, indexed);
+}
+
+// Check whether a block is named by more than one pointer.
+int dedup_shared(int bnum) { return dedup_extra[bnum] > 0; }
+
+// Take a block out of the index.
+void dedup_forget(int bnum)
+{
+  if (!bitmap_get(dedup_indexed, bnum))
+  {
+    return;
+  }
+  int *link = &dedup_head[dedup_fp[bnum] % DEDUP_BUCKETS];
+  while (*link != bnum)
+  {
+    link = &dedup_next[*link];
+  }
+  *link = dedup_next[bnum];
+  bitmap_put(dedup_indexed, bnum, 0);
+}
+
+// Drop one of the pointers to a block that is being freed.
+int dedup_release(int bnum)
+{
+  if (dedup_extra[bnum] > 0)
+  {
+    dedup_extra[bnum]--;
+    return 1;
+  }
+  dedup_forget(bnum);
+  return 0;
+}
+
+// Point the given block of the file at another block holding its bytes,
+// dropping the one it had.
+static void dedup_share(inode_t *node, int fbnum, int bnum)
+{
+  int old = inode_get_bnum(node, fbnum);
+  if (old == bnum)
+  {
+    return;
+  }
+  dedup_extra[bnum]++;
+  inode_set_bnum(node, fbnum, bnum);
+  if (old != 0)
+  {
+    free_block(old);
+  }
+  dedup_hits++;
+}
+
+// Store a whole block of a file by pointing at an identical one.
+int dedup_write(inode_t *node, int fbnum, const char *data)
+{
+  if (!dedup_active || fbnum >= INODE_MAX_BLOCKS)
+  {
+    return 0;
+  }
+  // the pointer goes in the indirect block, which must be there
+  if (fbnum > 0 && node->iblock == 0 && inode_set_bnum(node, fbnum, 0) == -1)
+  {
+    return 0;
+  }
+  int bnum = dedup_lookup(data, xxh64(data, BLOCK_SIZE, 0));
+  if (bnum == -1)
+  {
+    return 0;
+  }
+  dedup_share(node, fbnum, bnum);
+  return 1;
+}
+
+// Note that a write has filled a block of a file.
+void dedup_block(inode_t *node, int fbnum)
+{
+  int bnum = inode_get_bnum(node, fbnum);
+  if (!dedup_active || bnum == 0 || inode_unwritten(node, fbnum) ||
+      dedup_shared(bnum) || bitmap_get(dedup_indexed, bnum))
+  {
+    return;
+  }
+  const char *data = blocks_get_block(bnum);
+  u_int64_t fp = xxh64(data, BLOCK_SIZE, 0);
+  int match = dedup_lookup(data, fp);
+  if (match != -1)
+  {
+    dedup_share(node, fbnum, match);
+  }
+  else
+  {
+    dedup_index(bnum, fp);
+  }
+}
+
+// Report how much sharing saves.
+void dedup_stats(struct nufs_dedup *stats)
+{
+  void *ibm = get_inode_bitmap();
+  memset(stats, 0, sizeof(*stats));
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    inode_t *node = get_inode(inum);
+    if (!bitmap_get(ibm, inum) || node->mode == DIRECTORY_MODE)
+    {
+      continue;
+    }
+    int last = node->iblock != 0 ? INODE_MAX_BLOCKS : 1;
+    for (int fbnum = 0; fbnum < last; fbnum++)
+    {
+      stats->referenced += inode_get_bnum(node, fbnum) != 0;
+    }
+  }
+  stats->stored = stats->referenced;
+  for (int bnum = 0; bnum < blocks_count(); bnum++)
+  {
+    stats->stored -= dedup_extra[bnum];
+    stats->shared += dedup_extra[bnum] > 0;
+  }
+  stats->hits = dedup_hits;
+}
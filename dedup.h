@@ -0,0 +1,88 @@
+/**
+ * @file dedup.h
+ *
+ * Sharing identical data blocks between files.
+ *
+ * A data block may be named by several block pointers, in one file or in
+ * several. How many more than one is kept in memory, rebuilt from the inode
+ * table at mount: freeing a shared block only drops a reference, and
+ * writing to one gives the file a copy of its own first
+ * (inode_write_bnum).
+ *
+ * With the dedup mount option, every block a write fills is fingerprinted
+ * with XXH64 and looked up in an index of the blocks already stored; if one
+ * has the same bytes, the file points at it instead, and whole blocks are
+ * not even written. The index is in memory only and rebuilt at mount by
+ * hashing the image's full data blocks.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "inode.h"
+#include "nufs_ioctl.h"
+
+#define DEDUP_BUCKETS 4096 // fingerprint index hash chains
+
+/**
+ * Count the pointers naming each data block, and with active, fingerprint
+ * the data blocks and share identical ones from now on.
+ *
+ * @param active Whether to deduplicate writes.
+ */
+void dedup_init(int active);
+
+/**
+ * Check whether a block is named by more than one pointer.
+ *
+ * @param bnum Block number.
+ *
+ * @return 1 if it is shared, 0 if not.
+ */
+int dedup_shared(int bnum);
+
+/**
+ * Drop one of the pointers to a block that is being freed.
+ *
+ * @param bnum Block number.
+ *
+ * @return 1 if other pointers still name it, so it must not be freed, 0 if
+ * it can go.
+ */
+int dedup_release(int bnum);
+
+/**
+ * Take a block out of the index because its contents are about to change.
+ *
+ * @param bnum Block number.
+ */
+void dedup_forget(int bnum);
+
+/**
+ * Store a whole block of a file by pointing at a block that already holds
+ * the same bytes, if there is one.
+ *
+ * @param node The inode.
+ * @param fbnum Block of the file.
+ * @param data BLOCK_SIZE bytes to be written there.
+ *
+ * @return 1 if the block was stored that way, 0 if it must be written.
+ */
+int dedup_write(inode_t *node, int fbnum, const char *data);
+
+/**
+ * Note that a write has filled a block of a file: share it if another block
+ * holds the same bytes, otherwise add it to the index.
+ *
+ * @param node The inode.
+ * @param fbnum Block of the file.
+ */
+void dedup_block(inode_t *node, int fbnum);
+
+/**
+ * Report how much sharing saves.
+ *
+ * @param stats Filled in.
+ */
+void dedup_stats(struct nufs_dedup *stats);
+
+#endif
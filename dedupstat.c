@@ -0,0 +1,43 @@
+/**
+ * @file dedupstat.c
+ *
+ * dedupstat.nufs: show how much a mounted nufs volume saves by sharing
+ * identical data blocks between files.
+ *
+ * Usage: dedupstat.nufs path
+ *
+ * The path can be anything inside the mount. Prints the data blocks files
+ * name, the blocks actually stored for them and the ratio of the two.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: dedupstat.nufs path\n");
+    return 1;
+  }
+  struct nufs_dedup stats;
+  int fd = open(argv[1], O_RDONLY);
+  if (fd == -1 || ioctl(fd, NUFS_IOC_DEDUP, &stats) == -1)
+  {
+    fprintf(stderr, "dedupstat.nufs: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  close(fd);
+  printf("referenced blocks: %llu\n", (unsigned long long)stats.referenced);
+  printf("stored blocks:     %llu\n", (unsigned long long)stats.stored);
+  printf("dedup ratio:       %.2f\n",
+         stats.stored ? (double)stats.referenced / stats.stored : 1.0);
+  printf("shared blocks:     %llu\n", (unsigned long long)stats.shared);
+  printf("shared by writes:  %llu\n", (unsigned long long)stats.hits);
+  return 0;
+}
@@ -0,0 +1,206 @@
+/**
+ * @file defrag.c
+ *
+ * Online defragmenter implementation.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "append.h"
+#include "bitmap.h"
+#include "blocks.h"
+#include "dedup.h"
+#include "defrag.h"
+#include "directory.h"
+#include "inode.h"
+#include "orphan.h"
+#include "storage.h"
+
+static pthread_t defrag_thread;
+static pthread_cond_t defrag_cond = PTHREAD_COND_INITIALIZER;
+static int defrag_running = 0;
+static int defrag_stopping = 0;
+static int defrag_pending = 0; // a pass was asked for
+static int defrag_rate = 0;    // blocks per second for that pass, 0 unlimited
+
+// Move a file's data blocks into one contiguous run.
+int defrag_file(int inum)
+{
+  inode_t *node = get_inode(inum);
+  int count = 0;
+  int contiguous = 1;
+  int prev = 0;
+  for (int fbnum = 0; fbnum < INODE_MAX_BLOCKS; fbnum++)
+  {
+    int bnum = inode_get_bnum(node, fbnum);
+    if (bnum == 0)
+    {
+      continue;
+    }
+    if (dedup_shared(bnum))
+    { // moving it would give the file a copy of its own
+      return 0;
+    }
+    contiguous &= count == 0 || bnum == prev + 1;
+    prev = bnum;
+    count++;
+  }
+  if (contiguous)
+  {
+    return 0;
+  }
+  int run = blocks_find_run(count);
+  if (run == -1)
+  {
+    return 0;
+  }
+
+  // copy the blocks over, and make sure the copies are on disk before
+  // anything points at them
+  int moved = 0;
+  for (int fbnum = 0; fbnum < INODE_MAX_BLOCKS; fbnum++)
+  {
+    int bnum = inode_get_bnum(node, fbnum);
+    if (bnum == 0)
+    {
+      continue;
+    }
+    int dst = alloc_block_near(run + moved);
+    assert(dst == run + moved);
+    if (!inode_unwritten(node, fbnum))
+    {
+      memcpy(blocks_get_block(dst), blocks_get_block(bnum), BLOCK_SIZE);
+      blocks_mark_dirty(dst);
+    }
+    moved++;
+  }
+  blocks_sync();
+
+  // switch the block map over and free the old blocks
+  moved = 0;
+  for (int fbnum = 0; fbnum < INODE_MAX_BLOCKS; fbnum++)
+  {
+    int bnum = inode_get_bnum(node, fbnum);
+    if (bnum == 0)
+    {
+      continue;
+    }
+    u_int32_t flags = inode_unwritten(node, fbnum) ? INODE_UNWRITTEN : 0;
+    inode_set_bnum(node, fbnum, (run + moved) | flags);
+    free_block(bnum);
+    moved++;
+  }
+  append_forget(inum);
+  blocks_sync();
+  printf("+ defrag_file(%d) -> %d blocks to %d\n", inum, moved, run);
+  return moved;
+}
+
+// Sleep off the time moving the given number of blocks should take at the
+// given rate, without the storage lock.
+static void defrag_throttle(int moved, int rate)
+{
+  storage_unlock();
+  if (rate > 0 && moved > 0)
+  {
+    long ns = (long)moved * 1000000000L / rate;
+    struct timespec ts = {.tv_sec = ns / 1000000000L,
+                          .tv_nsec = ns % 1000000000L};
+    nanosleep(&ts, NULL);
+  }
+  storage_lock();
+}
+
+// One pass over the inode table, compacting directories and defragmenting
+// files.
+static void defrag_pass(int rate)
+{
+  void *ibm = get_inode_bitmap();
+  int files = 0;
+  int blocks = 0;
+  int dirs = 0;
+  for (int inum = 0; inum < INODE_COUNT && !defrag_stopping; inum++)
+  {
+    if (!bitmap_get(ibm, inum) || orphan_get(inum))
+    {
+      continue;
+    }
+    inode_t *node = get_inode(inum);
+    int moved = 0;
+    if (node->mode == DIRECTORY_MODE)
+    {
+      dirhead_t *dir = directory_head(blocks_get_block(node->block));
+      if (dir->num_free > 0)
+      {
+        directory_compact(dir);
+        blocks_mark_dirty(node->block);
+        dirs++;
+      }
+    }
+    else
+    {
+      moved = defrag_file(inum);
+      files += moved > 0;
+      blocks += moved;
+    }
+    defrag_throttle(moved, rate);
+  }
+  fprintf(stderr, "+ defrag_pass() -> %d files, %d blocks, %d directories\n",
+          files, blocks, dirs);
+}
+
+// Wait for a pass to be asked for, then do it.
+static void *defrag_main(void *arg)
+{
+  storage_lock();
+  while (!defrag_stopping)
+  {
+    if (defrag_pending)
+    {
+      defrag_pending = 0;
+      defrag_pass(defrag_rate);
+    }
+    else
+    {
+      storage_wait(&defrag_cond);
+    }
+  }
+  storage_unlock();
+  return NULL;
+}
+
+// Start the background defragmenter thread.
+void defrag_start()
+{
+  defrag_stopping = 0;
+  defrag_pending = 0;
+  int rv = pthread_create(&defrag_thread, NULL, defrag_main, NULL);
+  assert(rv == 0);
+  defrag_running = 1;
+}
+
+// Ask for a pass over the whole volume.
+void defrag_request(int rate)
+{
+  defrag_rate = rate;
+  defrag_pending = 1;
+  pthread_cond_signal(&defrag_cond);
+}
+
+// Stop the background defragmenter thread and wait for it.
+void defrag_stop()
+{
+  if (!defrag_running)
+  {
+    return;
+  }
+  storage_lock();
+  defrag_stopping = 1;
+  pthread_cond_signal(&defrag_cond);
+  storage_unlock();
+  pthread_join(defrag_thread, NULL);
+  defrag_running = 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * @file defrag.h
+ *
+ * Online defragmentation.
+ *
+ * A background thread, woken by the NUFS_IOC_DEFRAG ioctl, goes through the
+ * inode table once. The data blocks of each fragmented file are copied into
+ * the first free run long enough to hold them all, and the file's block map
+ * is then switched over to the copies in one go, under the storage lock, so
+ * readers only ever see the old blocks or the new ones. Directories with
+ * tombstoned slots are compacted on the way.
+ *
+ * The copies are synced before the block map is switched, and the switch
+ * before the old blocks can be reused, so a crash leaves the file intact
+ * either way. The lock is dropped after every file, and the I/O can be
+ * limited to a number of blocks per second.
+ */
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+/**
+ * Move the data blocks of a file into one contiguous run, if they are not
+ * already and a free run long enough can be found. Called with the storage
+ * lock held.
+ *
+ * @param inum The inode number.
+ *
+ * @return Number of blocks moved.
+ */
+int defrag_file(int inum);
+
+/**
+ * Start the background defragmenter thread. It sleeps until asked for a
+ * pass with defrag_request.
+ */
+void defrag_start();
+
+/**
+ * Ask for a defragmentation pass over the whole volume and return straight
+ * away. Called with the storage lock held.
+ *
+ * @param rate Most blocks to move per second, 0 for no limit.
+ */
+void defrag_request(int rate);
+
+/**
+ * Stop the background defragmenter thread, abandoning any pass in progress,
+ * and wait for it.
+ */
+void defrag_stop();
+
+#endif
@@ -0,0 +1,39 @@
+/**
+ * @file defragment.c
+ *
+ * defragment.nufs: defragment a mounted nufs volume.
+ *
+ * Usage: defragment.nufs mountpoint [blocks-per-second]
+ *
+ * Starts a pass of the background defragmenter and returns; the pass moves
+ * at most the given number of blocks per second (default: no limit).
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2 && argc != 3)
+  {
+    fprintf(stderr, "usage: defragment.nufs mountpoint [blocks-per-second]\n");
+    return 1;
+  }
+  u_int32_t rate = argc == 3 ? strtoul(argv[2], NULL, 0) : 0;
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd == -1 || ioctl(fd, NUFS_IOC_DEFRAG, &rate) == -1)
+  {
+    fprintf(stderr, "defragment.nufs: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  close(fd);
+  printf("%s: defragmenting in the background\n", argv[1]);
+  return 0;
+}
@@ -1,16 +1,73 @@
 #include "inode.h"
 #include "directory.h"
+#include "orphan.h"
+#include "usage.h"
 #include <assert.h>
 #include <string.h>
 
 
+// Entry slots [0, num_slots) have been handed out; each is either live
+// (present == 1) or a tombstone. Tombstones are chained into a free list
+// through their inum field, stored as slot index + 1 so that a zeroed header
+// means an empty list. Inserts pop the free list or append, so they never
+// scan; deletes push onto it and compact the block once tombstones make up
+// more than half of the slots.
+
+// rebuild the slot bookkeeping of a directory written before it existed,
+// when num_entries counted live entries and tombstones were found by scanning
+static void directory_upgrade(dirhead_t *dir) {
+  int end_index = dir->num_entries;
+  direntry_t *entries_start = (direntry_t *) (dir + 1);
+  for (int i = 0; i < end_index && i < (int) DIR_MAX_ENTRIES; i++) {
+    if (entries_start[i].present != 1) {
+      end_index++;
+    }
+  }
+  dir->num_slots = end_index < (int) DIR_MAX_ENTRIES ? end_index : DIR_MAX_ENTRIES;
+  directory_compact(dir);
+}
+
+// get the header of the directory stored in the given block
+dirhead_t *directory_head(void *block) {
+  dirhead_t *dir = (dirhead_t *) block;
+  if (dir->num_slots == 0 && dir->num_entries > 0) {
+    directory_upgrade(dir);
+  }
+  return dir;
+}
+
+// move the live entries of a directory down over its tombstones
+void directory_compact(dirhead_t *dir) {
+  direntry_t *entries_start = (direntry_t *) (dir + 1);
+  int live = 0;
+  for (int i = 0; i < dir->num_slots; i++) {
+    if (entries_start[i].present == 1) {
+      if (i != live) {
+        entries_start[live] = entries_start[i];
+      }
+      live++;
+    }
+  }
+  dir->num_slots = live;
+  dir->num_entries = live;
+  dir->free_head = 0;
+  dir->num_free = 0;
+}
+
+// set up an empty directory in the given directory inode's block
+void directory_init(inode_t *dd) {
+  dirhead_t *dir = (dirhead_t *) blocks_get_block(dd->block);
+  memset(dir, 0, sizeof(dirhead_t));
+  blocks_mark_dirty(dd->block);
+}
+
 // set up the root inode and confirm it is at the correct block
 void root_init() {
   int inum = alloc_inode(DIRECTORY_MODE);
   inode_t *root = get_inode(inum);
   fprintf(stderr, "+ Root block -> %d\n",root->block);
   assert(root->block == ROOT_BLOCK);
-  ((dirhead_t *) (blocks_get_block(root->block)))->num_entries = 0;
+  directory_init(root);
   directory_put(root, ".", inum);
 }
 
@@ -19,17 +76,13 @@ int directory_lookup(inode_t *dd, const char *name) {
   if (dd->mode != DIRECTORY_MODE) {
     return -1;
   }
-  dirhead_t *dir = (dirhead_t *) blocks_get_block(dd->block); 
-  int end_index = dir->num_entries;
+  dirhead_t *dir = directory_head(blocks_get_block(dd->block));
   direntry_t *entries_start = (direntry_t *) (dir + 1);
-  for (int i = 0; i < end_index; i++) {
+  for (int i = 0; i < dir->num_slots; i++) {
     direntry_t *entry = entries_start + i;
     if (entry->present == 1 && strcmp(entry->name, name) == 0) {
       return entry->inum;
     }
-    else if (entry->present == 0) {
-      end_index++;
-    }
   }
   return -1;
 }
@@ -52,21 +105,23 @@ int tree_lookup(const char *path) {
 }
 
 // add a file with the given name and inum to the given directory
+// returns 0 on success, -1 if the directory is full
 int directory_put(inode_t *dd, const char *name, int inum) {
   fprintf(stderr, "+ directory_put: %s -> %d\n", name, inum);
-  dirhead_t *dir = (dirhead_t *) blocks_get_block(dd->block); 
-  int num_entries = dir->num_entries;
+  dirhead_t *dir = directory_head(blocks_get_block(dd->block));
   direntry_t *entries_start = (direntry_t *) (dir + 1);
-  direntry_t *new_entry = NULL;
-  for (int i = 0; i < num_entries; i++) {
-    direntry_t *entry = entries_start + i;
-    if (entry->present == 0) {
-      new_entry = entry;
-      break;
-    }
+  direntry_t *new_entry;
+  if (dir->free_head != 0) {
+    new_entry = entries_start + (dir->free_head - 1);
+    dir->free_head = new_entry->inum;
+    dir->num_free--;
   }
-  if (new_entry == NULL) {
-    new_entry = entries_start + num_entries;
+  else if (dir->num_slots < (int) DIR_MAX_ENTRIES) {
+    new_entry = entries_start + dir->num_slots;
+    dir->num_slots++;
+  }
+  else {
+    return -1;
   }
 
   strcpy(new_entry->name, name);
@@ -74,46 +129,56 @@ int directory_put(inode_t *dd, const char *name, int inum) {
   new_entry->present = 1;
   dir->num_entries++;
   get_inode(inum)->ref_count++;
+  blocks_mark_dirty(dd->block);
+  blocks_mark_dirty(INODE_BLOCK);
+  if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    usage_link(dd - get_inode(0), inum);
+  }
   return 0;
 }
 
 // remove a file with the given name from the given directory
 int directory_delete(inode_t *dd, const char *name) {
-  dirhead_t *dir = (dirhead_t *) blocks_get_block(dd->block); 
-  int end_index = dir->num_entries;
+  dirhead_t *dir = directory_head(blocks_get_block(dd->block));
   direntry_t *entries_start = (direntry_t *) (dir + 1);
-  for (int i = 0; i < end_index; i++) {
+  for (int i = 0; i < dir->num_slots; i++) {
     direntry_t *entry = entries_start + i;
     if (entry->present == 1 && strcmp(entry->name, name) == 0) {
+      int inum = entry->inum;
       entry->present = 0;
+      entry->inum = dir->free_head;
+      dir->free_head = i + 1;
+      dir->num_free++;
       dir->num_entries--;
-      get_inode(entry->inum)->ref_count--;
-      if (get_inode(entry->inum)->ref_count == 0) {
-        free_inode(entry->inum);
+      if (dir->num_free * 2 > dir->num_slots) {
+        directory_compact(dir);
+      }
+      get_inode(inum)->ref_count--;
+      blocks_mark_dirty(dd->block);
+      blocks_mark_dirty(INODE_BLOCK);
+      if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+        usage_unlink(dd - get_inode(0), inum);
+      }
+      if (get_inode(inum)->ref_count == 0) {
+        // freed later by the reclaimer, once nothing has it open
+        orphan_add(inum);
       }
       return 0;
     }
-    else if (entry->present == 0) {
-      end_index++;
-    }
   }
   return 1;
 }
 
 // return an slist of the files in the given directory
 slist_t *directory_list(inode_t *dd) {
-  dirhead_t *dir = (dirhead_t *) blocks_get_block(dd->block); 
-  int end_index = dir->num_entries;
+  dirhead_t *dir = directory_head(blocks_get_block(dd->block));
   direntry_t *entries_start = (direntry_t *) (dir + 1);
   slist_t *list = NULL;  
-  for (int i = 0; i < end_index; i++) {
+  for (int i = 0; i < dir->num_slots; i++) {
     direntry_t *entry = entries_start + i;
     if (entry->present == 1) {
       list = s_cons(entry->name, list);
     }
-    else if (entry->present == 0) {
-      end_index++;
-    }
   }
   return list;
 }
@@ -131,18 +196,12 @@ slist_t *directory_list_path(const char *path) {
 
 // return the inum of a directory that is at the given block
 int get_inum_from_block(void * block) {
-  dirhead_t *dir = (dirhead_t *) block;
-  int end_index = dir->num_entries;
+  dirhead_t *dir = directory_head(block);
   direntry_t *entries_start = (direntry_t *) (dir + 1);
-  for (int i = 0; i < end_index; i++) {
+  for (int i = 0; i < dir->num_slots; i++) {
     direntry_t *entry = entries_start + i;
-    if (entry->present == 1) {
-      if (strcmp(entry->name, ".") == 0) {
-        return entry->inum;
-      }
-    }
-    else if (entry->present == 0) {
-      end_index++;
+    if (entry->present == 1 && strcmp(entry->name, ".") == 0) {
+      return entry->inum;
     }
   }
   return -1;
@@ -15,8 +15,15 @@
 #include "slist.h"
 
 typedef struct dirhead {
-  int num_entries;
-  int _reserved[15];
+  int num_entries; // live entries
+  int num_slots;   // entry slots handed out, live or tombstoned
+  int free_head;   // first tombstoned slot + 1, 0 if none
+  int num_free;    // tombstones on the free list
+  // totals for everything beneath the directory, see usage.h
+  int64_t du_bytes;
+  int32_t du_blocks;
+  int32_t du_files;
+  int _reserved[8];
 } dirhead_t;
 
 typedef struct direntry {
@@ -26,6 +33,12 @@ typedef struct direntry {
   char _reserved[10];
 } direntry_t;
 
+// number of entry slots that fit in a directory block
+#define DIR_MAX_ENTRIES ((BLOCK_SIZE - sizeof(dirhead_t)) / sizeof(direntry_t))
+
+dirhead_t *directory_head(void *block);
+void directory_compact(dirhead_t *dir);
+void directory_init(inode_t *dd);
 void root_init();
 int directory_lookup(inode_t *dd, const char *name);
 int tree_lookup(const char *path);
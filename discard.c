@@ -0,0 +1,74 @@
+/**
+ * @file discard.c
+ *
+ * Background discard thread implementation.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "discard.h"
+#include "storage.h"
+
+static pthread_t discard_thread;
+static pthread_cond_t discard_cond = PTHREAD_COND_INITIALIZER;
+static int discard_running = 0;
+static int discard_stopping = 0;
+
+// Every DISCARD_INTERVAL seconds, write back the blocks if any were freed
+// since the last sync, so the bitmap saying they are free is on disk (the
+// lazy timestamps are left for a real sync), then discard the ones that are
+// ready a batch at a time, dropping the lock in between batches.
+static void *discard_main(void *arg)
+{
+  storage_lock();
+  while (!discard_stopping)
+  {
+    if (blocks_discard_pending())
+    {
+      blocks_sync();
+    }
+    while (!discard_stopping && blocks_discard(DISCARD_BATCH) > 0)
+    {
+      storage_unlock();
+      sched_yield();
+      storage_lock();
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += DISCARD_INTERVAL;
+    storage_timedwait(&discard_cond, &until);
+  }
+  storage_unlock();
+  return NULL;
+}
+
+// Queue every free block and start the background discard thread.
+void discard_start()
+{
+  storage_lock();
+  blocks_discard_all();
+  storage_unlock();
+  discard_stopping = 0;
+  int rv = pthread_create(&discard_thread, NULL, discard_main, NULL);
+  assert(rv == 0);
+  discard_running = 1;
+}
+
+// Stop the background discard thread and wait for it.
+void discard_stop()
+{
+  if (!discard_running)
+  {
+    return;
+  }
+  storage_lock();
+  discard_stopping = 1;
+  pthread_cond_signal(&discard_cond);
+  storage_unlock();
+  pthread_join(discard_thread, NULL);
+  discard_running = 0;
+}
@@ -0,0 +1,29 @@
+/**
+ * @file discard.h
+ *
+ * Background discard of freed blocks (the discard mount option).
+ *
+ * Freed blocks are handed back to the host by punching holes in the image
+ * files, so the space the images take up follows the live data. A block is
+ * only punched once the bitmap saying it is free has been written back, so
+ * a crash cannot bring back a file whose data was punched away. A background
+ * thread does the work a batch at a time, syncing first when blocks have
+ * been freed since the last sync.
+ */
+#ifndef DISCARD_H
+#define DISCARD_H
+
+#define DISCARD_BATCH 64   // blocks discarded per hold of the storage lock
+#define DISCARD_INTERVAL 5 // seconds between passes
+
+/**
+ * Queue every free block and start the background discard thread.
+ */
+void discard_start();
+
+/**
+ * Stop the background discard thread, if it is running, and wait for it.
+ */
+void discard_stop();
+
+#endif
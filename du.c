@@ -0,0 +1,50 @@
+/**
+ * @file du.c
+ *
+ * du.nufs: show how much is beneath directories of a mounted nufs volume,
+ * straight from the totals each directory keeps, without walking them.
+ *
+ * Usage: du.nufs path...
+ *
+ * Prints the bytes, blocks and files beneath each path, as du -l would
+ * count them.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: du.nufs path...\n");
+    return 1;
+  }
+  int rv = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    struct nufs_usage usage;
+    int fd = open(argv[i], O_RDONLY);
+    if (fd == -1 || ioctl(fd, NUFS_IOC_USAGE, &usage) == -1)
+    {
+      fprintf(stderr, "du.nufs: %s: %s\n", argv[i], strerror(errno));
+      rv = 1;
+    }
+    else
+    {
+      printf("%llu bytes\t%llu blocks\t%llu files\t%s\n",
+             (unsigned long long)usage.bytes, (unsigned long long)usage.blocks,
+             (unsigned long long)usage.files, argv[i]);
+    }
+    if (fd != -1)
+    {
+      close(fd);
+    }
+  }
+  return rv;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file export.c
+ *
+ * export.nufs: write the allocated blocks of an unmounted nufs image to a
+ * file or to stdout, in the format described in stream.h.
+ *
+ * Usage: export.nufs [-z] [-s generation] [-o file] image[,image...]
+ *
+ * Free blocks are left out, and blocks of zeros take no space. With -z the
+ * other blocks are PackBits compressed where that makes them smaller. With
+ * -s only the blocks in groups written since the given generation are
+ * exported, so applying the stream to a copy of the image as it was at that
+ * generation brings the copy up to date. Block 0, which holds the bitmaps
+ * and the superblock, is always exported.
+ *
+ * The generation of the image is printed, to be given to -s next time.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "stream.h"
+#include "super.h"
+
+static void usage()
+{
+  fprintf(stderr,
+          "usage: export.nufs [-z] [-s generation] [-o file] image[,image...]\n");
+  exit(1);
+}
+
+// Check whether a block is all zeros.
+static int block_is_zero(const char *block)
+{
+  return block[0] == 0 && memcmp(block, block + 1, BLOCK_SIZE - 1) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int compress = 0;
+  u_int32_t since = 0;
+  const char *out_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "zs:o:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'z':
+      compress = 1;
+      break;
+    case 's':
+      since = strtoul(optarg, NULL, 0);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1)
+  {
+    usage();
+  }
+  const char *image_path = argv[optind];
+
+  if (!super_load(image_path, BLOCKS_STRIPE_UNIT, BLOCKS_RDONLY))
+  {
+    fprintf(stderr, "export.nufs: %s has no nufs superblock\n", image_path);
+    blocks_free();
+    return 1;
+  }
+  superblock_t *sb = get_superblock();
+  if (sb->state != SUPER_CLEAN)
+  {
+    fprintf(stderr, "export.nufs: %s is mounted or was not unmounted "
+                    "cleanly\n",
+            image_path);
+    blocks_free();
+    return 1;
+  }
+
+  FILE *out = out_path ? fopen(out_path, "w") : stdout;
+  if (out == NULL)
+  {
+    fprintf(stderr, "export.nufs: %s: %s\n", out_path, strerror(errno));
+    blocks_free();
+    return 1;
+  }
+
+  stream_header_t hdr;
+  hdr.block_count = blocks_count();
+  hdr.ndevs = blocks_device_count();
+  hdr.stripe_unit = blocks_stripe_unit();
+  hdr.generation = sb->generation;
+  hdr.since = since;
+  int rv = stream_write_header(out, &hdr);
+
+  static char packed[STREAM_PACK_MAX];
+  void *bbm = get_blocks_bitmap();
+  int exported = 0;
+  for (int bnum = 0; bnum < blocks_count() && rv == 0; bnum++)
+  {
+    if (bnum != 0 && (!bitmap_get(bbm, bnum) ||
+                      (since != 0 &&
+                       sb->group_gen[bnum / BLOCKS_PER_GROUP] <= since)))
+    {
+      continue;
+    }
+    char *block = blocks_get_block(bnum);
+    stream_record_t rec = {.bnum = bnum, .flags = 0, .len = BLOCK_SIZE};
+    const void *data = block;
+    if (block_is_zero(block))
+    {
+      rec.flags = STREAM_ZERO;
+      rec.len = 0;
+    }
+    else if (compress)
+    {
+      int len = stream_pack(block, packed);
+      if (len < BLOCK_SIZE)
+      {
+        rec.flags = STREAM_PACKED;
+        rec.len = len;
+        data = packed;
+      }
+    }
+    rv = stream_write_record(out, &rec, data);
+    exported++;
+  }
+  stream_record_t end = {.bnum = STREAM_END, .flags = 0, .len = 0};
+  if (rv == 0)
+  {
+    rv = stream_write_record(out, &end, NULL);
+  }
+  if (fflush(out) != 0 || (out != stdout && fclose(out) != 0))
+  {
+    rv = -1;
+  }
+  int total = blocks_count();
+  blocks_free();
+
+  if (rv != 0)
+  {
+    fprintf(stderr, "export.nufs: %s: %s\n", out_path ? out_path : "stdout",
+            strerror(errno));
+    return 1;
+  }
+  fprintf(stderr, "%s: generation %u, %d of %d blocks exported\n", image_path,
+          hdr.generation, exported, total);
+  return 0;
+}
@@ -0,0 +1,184 @@
+/**
+ * @file frag.c
+ *
+ * Implementation of tail packing.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "frag.h"
+#include "usage.h"
+
+// per block, a bit for each of its fragments that is in use; a block with
+// any bit set is a fragment block
+static u_int8_t frag_used[BLOCKS_MAX_COUNT];
+
+// Rebuild the map of fragments in use from the inode table.
+void frag_init()
+{
+  void *ibm = get_inode_bitmap();
+  memset(frag_used, 0, sizeof(frag_used));
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    inode_t *node = get_inode(inum);
+    if (bitmap_get(ibm, inum) && node->tail != 0)
+    {
+      frag_used[FRAG_BNUM(node->tail)] |= FRAG_MASK(node->tail);
+    }
+  }
+}
+
+// Find the first run of count free fragments in the given map, or -1.
+static int frag_find(u_int8_t used, int count)
+{
+  int mask = (1 << count) - 1;
+  for (int first = 0; first + count <= FRAGS_PER_BLOCK; first++)
+  {
+    if ((used & (mask << first)) == 0)
+    {
+      return first;
+    }
+  }
+  return -1;
+}
+
+// Allocate a run of count fragments in the fragment block with the fewest
+// free ones that has room, or in a new block; returns its tail, or 0 if the
+// disk is full.
+static u_int32_t frag_alloc(int count)
+{
+  int best = -1;
+  int best_free = FRAGS_PER_BLOCK;
+  for (int bnum = 1; bnum < blocks_count(); bnum++)
+  {
+    u_int8_t used = frag_used[bnum];
+    if (used == 0 || used == 0xff)
+    {
+      continue;
+    }
+    int nfree = FRAGS_PER_BLOCK - __builtin_popcount(used);
+    if (nfree < best_free && frag_find(used, count) != -1)
+    {
+      best = bnum;
+      best_free = nfree;
+    }
+  }
+  if (best == -1)
+  {
+    best = alloc_block();
+    if (best == -1)
+    {
+      return 0;
+    }
+  }
+  u_int32_t tail = FRAG_TAIL(best, frag_find(frag_used[best], count), count);
+  frag_used[best] |= FRAG_MASK(tail);
+  return tail;
+}
+
+// Data of the given tail.
+static char *frag_data(u_int32_t tail)
+{
+  return (char *)blocks_get_block(FRAG_BNUM(tail)) + FRAG_FIRST(tail) * FRAG_SIZE;
+}
+
+// Check whether the file has blocks past the given one, as preallocating
+// past the end leaves.
+static int frag_blocks_after(inode_t *node, int fbnum)
+{
+  for (int ii = fbnum + 1; ii < INODE_MAX_BLOCKS && node->iblock != 0; ii++)
+  {
+    if (inode_get_bnum(node, ii) != 0)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Pack the last block of a file into fragments.
+int frag_pack(int inum)
+{
+  inode_t *node = get_inode(inum);
+  int fbnum = node->size / BLOCK_SIZE;
+  int len = node->size % BLOCK_SIZE;
+  int bnum = inode_get_bnum(node, fbnum);
+  if (node->mode == DIRECTORY_MODE || node->tail != 0 || bnum == 0 ||
+      inode_unwritten(node, fbnum) || frag_blocks_after(node, fbnum))
+  {
+    return 0;
+  }
+  int count = (len + FRAG_SIZE - 1) / FRAG_SIZE;
+  if (count == FRAGS_PER_BLOCK)
+  { // would take a whole block anyway
+    return 0;
+  }
+  if (count > 0)
+  {
+    u_int32_t tail = frag_alloc(count);
+    if (tail == 0)
+    {
+      return 0;
+    }
+    memcpy(frag_data(tail), blocks_get_block(bnum), len);
+    blocks_mark_dirty(FRAG_BNUM(tail));
+    node->tail = tail;
+  }
+  inode_set_bnum(node, fbnum, 0);
+  free_block(bnum);
+  inode_drop_iblock(node);
+  blocks_mark_dirty(INODE_BLOCK);
+  usage_dirty(inum);
+  printf("+ frag_pack(%d) -> %d fragments\n", inum, count);
+  return 1;
+}
+
+// Promote a file's tail back to a block of its own.
+int frag_unpack(int inum)
+{
+  inode_t *node = get_inode(inum);
+  if (node->tail == 0)
+  {
+    return 0;
+  }
+  int bnum = inode_alloc_bnum(node, node->size / BLOCK_SIZE, 0);
+  if (bnum == -1)
+  {
+    return -1;
+  }
+  memcpy(blocks_get_block(bnum), frag_data(node->tail), node->size % BLOCK_SIZE);
+  blocks_mark_dirty(bnum);
+  frag_free(node);
+  usage_dirty(inum);
+  printf("+ frag_unpack(%d) -> %d\n", inum, bnum);
+  return 0;
+}
+
+// Release a file's fragments.
+void frag_free(inode_t *node)
+{
+  if (node->tail == 0)
+  {
+    return;
+  }
+  int bnum = FRAG_BNUM(node->tail);
+  frag_used[bnum] &= ~FRAG_MASK(node->tail);
+  if (frag_used[bnum] == 0)
+  {
+    free_block(bnum);
+  }
+  node->tail = 0;
+  blocks_mark_dirty(INODE_BLOCK);
+}
+
+// Return the packed tail of a file if the given block of it is the tail.
+const char *frag_tail(inode_t *node, int fbnum)
+{
+  if (node->tail == 0 || fbnum != node->size / BLOCK_SIZE)
+  {
+    return NULL;
+  }
+  return frag_data(node->tail);
+}
@@ -0,0 +1,76 @@
+/**
+ * @file frag.h
+ *
+ * Packing the tails of files into fragments of shared blocks.
+ *
+ * A file's last block is usually partly empty, and a small file is nothing
+ * but that block. When a file is closed for the last time, its last block,
+ * if partial, is moved into a run of FRAG_SIZE fragments of a block shared
+ * with the tails of other files, and the inode's tail field names the run;
+ * an empty file gives up its block altogether. Before anything changes a
+ * packed file its tail is promoted back to a block of its own, to be packed
+ * again when it is next closed.
+ *
+ * Which fragments of each block are in use is kept in memory only, and
+ * rebuilt from the inode table at mount.
+ */
+#ifndef FRAG_H
+#define FRAG_H
+
+#include "inode.h"
+
+#define FRAG_SIZE 512
+#define FRAGS_PER_BLOCK (BLOCK_SIZE / FRAG_SIZE) // fits the bits of a byte
+
+// A tail names its block, its first fragment and its number of fragments;
+// 0 means none, as block 0 never holds fragments
+#define FRAG_TAIL(bnum, first, count) \
+  (((bnum) * FRAGS_PER_BLOCK + (first)) * FRAGS_PER_BLOCK + (count) - 1)
+#define FRAG_BNUM(tail) ((tail) / (FRAGS_PER_BLOCK * FRAGS_PER_BLOCK))
+#define FRAG_FIRST(tail) ((tail) / FRAGS_PER_BLOCK % FRAGS_PER_BLOCK)
+#define FRAG_COUNT(tail) ((tail) % FRAGS_PER_BLOCK + 1)
+#define FRAG_MASK(tail) (((1 << FRAG_COUNT(tail)) - 1) << FRAG_FIRST(tail))
+
+/**
+ * Rebuild the map of fragments in use from the inode table.
+ */
+void frag_init();
+
+/**
+ * Pack the last block of a file into fragments, if it is partial and it is
+ * the last block the file has. Call when the file is closed.
+ *
+ * @param inum The inode number.
+ *
+ * @return 1 if the file was packed, 0 if not.
+ */
+int frag_pack(int inum);
+
+/**
+ * Promote a file's tail back to a block of its own. Call before changing
+ * the file's size or blocks.
+ *
+ * @param inum The inode number.
+ *
+ * @return 0 on success (or if the file has no tail), -1 if the disk is full.
+ */
+int frag_unpack(int inum);
+
+/**
+ * Release a file's fragments, e.g. when it is freed.
+ *
+ * @param node The inode.
+ */
+void frag_free(inode_t *node);
+
+/**
+ * Return the packed tail of a file if the given block of it is the tail.
+ *
+ * @param node The inode.
+ * @param fbnum Block of the file.
+ *
+ * @return Pointer to the tail's data, or NULL.
+ */
+const char *frag_tail(inode_t *node, int fbnum);
+
+#endif
@@ -0,0 +1,674 @@
+/**
+ * @file fsck.c
+ *
+ * fsck.nufs: check, and optionally repair, a nufs image offline.
+ *
+ * A cleanly unmounted image is trusted unless -f is given. Otherwise the
+ * image is checked in parallel phases, each one split across worker threads:
+ *
+ *   1. every allocated inode claims its blocks and the fragments its tail
+ *      is packed into, after the checksum blocks are claimed, catching
+ *      blocks and fragments that are claimed twice;
+ *   2. the tree is walked breadth first from the root, one level at a time,
+ *      counting the directory entries that name each inode;
+ *   3. every allocated inode is checked for reachability and its ref_count
+ *      compared with the number of entries naming it; inodes on the orphan
+ *      list are expected to be unreachable, with a ref_count of 0;
+ *   4. the block bitmap is compared with the blocks actually claimed.
+ *
+ * Finally the superblock's free counters are compared with the bitmaps.
+ *
+ * Usage: fsck.nufs [-n | -y] [-f] [-j threads] image[,image...]
+ *
+ * With -n (the default) the image is opened read-only. With -y problems are repaired and
+ * the image is marked clean once none are left. Repairs that touch shared
+ * structures (the bitmaps) are applied single-threaded after the checks.
+ *
+ * Exit status follows fsck(8): 0 no problems, 1 problems corrected, 4
+ * problems left uncorrected, 8 operational error.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "directory.h"
+#include "frag.h"
+#include "inode.h"
+#include "orphan.h"
+#include "super.h"
+
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+static int repair = 0;  // -y: fix what can be fixed
+static int nthreads = 1;
+
+static atomic_int owner[BLOCKS_MAX_COUNT]; // inum claiming each block, -1 if none
+static atomic_int frags[BLOCKS_MAX_COUNT]; // fragments of each block claimed
+#define OWNER_FRAGS -2 // owner of a block holding packed tails
+#define OWNER_CSUM -3  // owner of a checksum block
+static atomic_int meta[BLOCKS_MAX_COUNT];  // block is claimed as an indirect block
+static atomic_int refs[BLOCKS_MAX_COUNT];  // data pointers naming each block
+static atomic_int links[INODE_COUNT];    // directory entries naming each inode
+static atomic_int reached[INODE_COUNT];  // inode is reachable from the root
+static char unreachable[INODE_COUNT];   // allocated but not reachable
+static char dir_changed[INODE_COUNT];   // directory block was rewritten
+static char drop_orphan[INODE_COUNT];   // wrongly on the orphan list
+static atomic_int corrected;
+static atomic_int uncorrected;
+
+// breadth first walk state: the current level and the one being built
+static int frontier[INODE_COUNT];
+static int frontier_count;
+static int next_frontier[INODE_COUNT];
+static atomic_int next_count;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct range {
+  int lo;
+  int hi;
+} range_t;
+
+// Print a problem, counting it as corrected if we are repairing and it can
+// be fixed.
+static void report(int fixable, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  pthread_mutex_lock(&report_lock);
+  vprintf(fmt, ap);
+  printf(repair && fixable ? " (fixed)\n" : "\n");
+  pthread_mutex_unlock(&report_lock);
+  va_end(ap);
+  atomic_fetch_add(repair && fixable ? &corrected : &uncorrected, 1);
+}
+
+// Run fn over [0, n) split into one contiguous range per thread.
+static void run_parallel(void *(*fn)(void *), int n)
+{
+  pthread_t threads[nthreads];
+  range_t ranges[nthreads];
+  int per = (n + nthreads - 1) / nthreads;
+  for (int t = 0; t < nthreads; t++)
+  {
+    ranges[t].lo = t * per < n ? t * per : n;
+    ranges[t].hi = (t + 1) * per < n ? (t + 1) * per : n;
+    int rv = pthread_create(&threads[t], NULL, fn, &ranges[t]);
+    assert(rv == 0);
+  }
+  for (int t = 0; t < nthreads; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+}
+
+static int inode_allocated(int inum)
+{
+  return inum >= 0 && inum < INODE_COUNT &&
+         bitmap_get(get_inode_bitmap(), inum);
+}
+
+// Claim one block for the given inode. Data blocks may be claimed more than
+// once, since deduplication shares identical blocks (see dedup.h); indirect
+// blocks never are.
+static void claim_block(int inum, u_int32_t bnum, int data)
+{
+  if (bnum == 0)
+  {
+    return;
+  }
+  if (bnum >= blocks_count() || bnum == INODE_BLOCK)
+  {
+    report(0, "inode %d: block %u is out of range", inum, bnum);
+    return;
+  }
+  // mark the kind of claim before racing for ownership, so whichever
+  // claimant loses sees what the other one was
+  if (data)
+  {
+    atomic_fetch_add(&refs[bnum], 1);
+  }
+  else
+  {
+    atomic_store(&meta[bnum], 1);
+  }
+  int expected = -1;
+  if (!atomic_compare_exchange_strong(&owner[bnum], &expected, inum))
+  {
+    if (data && expected >= 0 && !atomic_load(&meta[bnum]))
+    {
+      return;
+    }
+    if (expected == OWNER_FRAGS)
+    {
+      report(0, "block %u is claimed by inode %d and by packed tails", bnum,
+             inum);
+      return;
+    }
+    if (expected == OWNER_CSUM)
+    {
+      report(0, "block %u is claimed by inode %d and holds checksums", bnum,
+             inum);
+      return;
+    }
+    report(0, "block %u is claimed by inodes %d and %d", bnum, expected, inum);
+  }
+}
+
+// Claim the blocks the superblock lists as holding checksums, before any
+// inode claims its own.
+static void claim_csum_blocks()
+{
+  superblock_t *sb = get_superblock();
+  for (int region = 0; region < CSUM_REGIONS; region++)
+  {
+    u_int32_t bnum = sb->csum_blocks[region];
+    if (bnum == 0)
+    {
+      continue;
+    }
+    int expected = -1;
+    if (bnum >= blocks_count() || bnum == INODE_BLOCK ||
+        !atomic_compare_exchange_strong(&owner[bnum], &expected, OWNER_CSUM))
+    {
+      report(0, "checksum block %u of region %d is out of range or listed "
+                "twice", bnum, region);
+    }
+  }
+}
+
+// Check whether an inode's tail names fragments that exist.
+static int tail_valid(inode_t *node)
+{
+  u_int32_t bnum = FRAG_BNUM(node->tail);
+  return bnum != 0 && bnum != INODE_BLOCK && bnum < blocks_count() &&
+         FRAG_FIRST(node->tail) + FRAG_COUNT(node->tail) <= FRAGS_PER_BLOCK;
+}
+
+// Claim the fragments an inode's tail is packed into. Their block is shared
+// with other tails, so it is owned by none of them.
+static void claim_tail(int inum, inode_t *node)
+{
+  if (node->tail == 0)
+  {
+    return;
+  }
+  int len = node->size % BLOCK_SIZE;
+  if (!tail_valid(node) || len == 0 ||
+      len > FRAG_COUNT(node->tail) * FRAG_SIZE)
+  {
+    report(0, "inode %d: tail %u does not fit its size of %u", inum,
+           node->tail, node->size);
+    return;
+  }
+  u_int32_t bnum = FRAG_BNUM(node->tail);
+  int expected = -1;
+  if (!atomic_compare_exchange_strong(&owner[bnum], &expected, OWNER_FRAGS) &&
+      expected != OWNER_FRAGS)
+  {
+    report(0, "block %u is claimed by inode %d and by packed tails", bnum,
+           expected);
+    return;
+  }
+  if (atomic_fetch_or(&frags[bnum], FRAG_MASK(node->tail)) &
+      FRAG_MASK(node->tail))
+  {
+    report(0, "inode %d: fragments of block %u are claimed twice", inum, bnum);
+  }
+}
+
+// List the blocks an inode refers to: its first block, its indirect block
+// and the blocks named in its indirect block, if that one is in range.
+// Returns how many were stored in bnums; all but bnums[1] hold data.
+static int inode_blocks(inode_t *node, u_int32_t *bnums)
+{
+  int count = 0;
+  bnums[count++] = node->block & ~INODE_UNWRITTEN;
+  bnums[count++] = node->iblock;
+  if (node->iblock != 0 && node->iblock < blocks_count() &&
+      node->iblock != INODE_BLOCK)
+  {
+    u_int32_t *ptrs = blocks_get_block(node->iblock);
+    for (int ii = 0; ii < INODE_PTRS; ii++)
+    {
+      if (ptrs[ii] != 0)
+      {
+        bnums[count++] = ptrs[ii] & ~INODE_UNWRITTEN;
+      }
+    }
+  }
+  return count;
+}
+
+// Phase 1: every allocated inode claims its blocks.
+static void *claim_blocks(void *arg)
+{
+  range_t *r = arg;
+  u_int32_t bnums[INODE_MAX_BLOCKS + 1];
+  for (int inum = r->lo; inum < r->hi; inum++)
+  {
+    if (!inode_allocated(inum))
+    {
+      continue;
+    }
+    int count = inode_blocks(get_inode(inum), bnums);
+    for (int k = 0; k < count; k++)
+    {
+      claim_block(inum, bnums[k], k != 1);
+    }
+    claim_tail(inum, get_inode(inum));
+  }
+  return NULL;
+}
+
+// Phase 2: scan one level of directories, counting the entries that name
+// each inode and queueing the subdirectories found.
+static void *walk_level(void *arg)
+{
+  range_t *r = arg;
+  for (int i = r->lo; i < r->hi; i++)
+  {
+    int dnum = frontier[i];
+    inode_t *dd = get_inode(dnum);
+    dirhead_t *dir = directory_head(blocks_get_block(dd->block));
+    direntry_t *entries = (direntry_t *)(dir + 1);
+    if (dir->num_slots > (int)DIR_MAX_ENTRIES)
+    {
+      report(0, "directory inode %d: %d entry slots do not fit in block %u",
+             dnum, dir->num_slots, dd->block);
+      continue;
+    }
+
+    int live = 0;
+    int tombstones = 0;
+    for (int j = 0; j < dir->num_slots; j++)
+    {
+      direntry_t *entry = &entries[j];
+      if (entry->present != 1)
+      {
+        tombstones++;
+        continue;
+      }
+      int inum = entry->inum;
+      if (!inode_allocated(inum))
+      {
+        report(1, "directory inode %d: entry '%.*s' names free inode %d", dnum,
+               DIR_NAME_LENGTH, entry->name, inum);
+        if (repair)
+        {
+          entry->present = 0;
+          dir_changed[dnum] = 1;
+        }
+        continue;
+      }
+      live++;
+      atomic_fetch_add(&links[inum], 1);
+      if (!atomic_exchange(&reached[inum], 1) &&
+          get_inode(inum)->mode == DIRECTORY_MODE)
+      {
+        next_frontier[atomic_fetch_add(&next_count, 1)] = inum;
+      }
+    }
+    if (live != dir->num_entries || tombstones != dir->num_free)
+    {
+      report(1, "directory inode %d: counts %d live and %d free entries, "
+                "found %d and %d",
+             dnum, dir->num_entries, dir->num_free, live, tombstones);
+      dir_changed[dnum] = 1;
+    }
+    if (repair && dir_changed[dnum])
+    {
+      // rebuilds the counts and the free list from the slots themselves
+      directory_compact(dir);
+    }
+  }
+  return NULL;
+}
+
+// Phase 3: check reachability and reference counts.
+static void *check_inodes(void *arg)
+{
+  range_t *r = arg;
+  for (int inum = r->lo; inum < r->hi; inum++)
+  {
+    int orphan = orphan_get(inum);
+    if (!inode_allocated(inum))
+    {
+      if (orphan)
+      {
+        report(1, "free inode %d is on the orphan list", inum);
+        drop_orphan[inum] = 1;
+      }
+      continue;
+    }
+    inode_t *node = get_inode(inum);
+    int is_reached = atomic_load(&reached[inum]);
+    if (orphan && is_reached)
+    {
+      report(1, "inode %d is on the orphan list but still linked", inum);
+      drop_orphan[inum] = 1;
+    }
+    else if (!orphan && !is_reached)
+    {
+      report(1, "inode %d is not reachable from the root", inum);
+      unreachable[inum] = 1;
+      continue;
+    }
+    int count = atomic_load(&links[inum]);
+    if (node->ref_count != count)
+    {
+      report(1, "inode %d: ref_count is %d, but %d entries name it", inum,
+             node->ref_count, count);
+      if (repair)
+      {
+        node->ref_count = count;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Phase 4: compare the block bitmap with the blocks actually claimed.
+static void *check_bitmap(void *arg)
+{
+  range_t *r = arg;
+  void *bbm = get_blocks_bitmap();
+  for (int bnum = r->lo; bnum < r->hi; bnum++)
+  {
+    // block 0 and the inode table belong to the filesystem itself
+    int used = bnum == 0 || bnum == INODE_BLOCK ||
+               atomic_load(&owner[bnum]) != -1;
+    if (used == bitmap_get(bbm, bnum))
+    {
+      continue;
+    }
+    if (used)
+    {
+      report(1, "block %d is in use but marked free", bnum);
+    }
+    else
+    {
+      report(1, "block %d is marked in use but nothing claims it", bnum);
+    }
+  }
+  return NULL;
+}
+
+// The bitmaps are updated a byte at a time and so cannot be shared between
+// threads; repairs to them are applied here, single-threaded.
+
+// Free the unreachable inodes, releasing the blocks they alone claim, write
+// back the directories that were rewritten and fix up the orphan list.
+static void fix_inodes()
+{
+  void *ibm = get_inode_bitmap();
+  u_int32_t bnums[INODE_MAX_BLOCKS + 1];
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    if (unreachable[inum])
+    {
+      // release the inode and whatever blocks it alone claims; a shared
+      // data block goes with its last reference
+      inode_t *node = get_inode(inum);
+      int count = inode_blocks(node, bnums);
+      for (int k = 0; k < count; k++)
+      {
+        u_int32_t bnum = bnums[k];
+        if (bnum == 0 || bnum >= blocks_count())
+        {
+          continue;
+        }
+        if (k != 1 && atomic_load(&owner[bnum]) >= 0 &&
+            !atomic_load(&meta[bnum]))
+        {
+          if (atomic_fetch_sub(&refs[bnum], 1) == 1)
+          {
+            atomic_store(&owner[bnum], -1);
+          }
+        }
+        else if (atomic_load(&owner[bnum]) == inum)
+        {
+          atomic_store(&owner[bnum], -1);
+        }
+      }
+      // and its fragments, and their block once no tail is left in it
+      u_int32_t fbnum = FRAG_BNUM(node->tail);
+      if (node->tail != 0 && tail_valid(node) &&
+          atomic_load(&owner[fbnum]) == OWNER_FRAGS &&
+          (atomic_fetch_and(&frags[fbnum], ~FRAG_MASK(node->tail)) &
+           ~FRAG_MASK(node->tail)) == 0)
+      {
+        atomic_store(&owner[fbnum], -1);
+      }
+      bitmap_put(ibm, inum, 0);
+    }
+    if (dir_changed[inum])
+    {
+      blocks_mark_dirty(get_inode(inum)->block);
+    }
+    if (drop_orphan[inum])
+    {
+      bitmap_put(get_superblock()->orphans, inum, 0);
+    }
+  }
+  blocks_mark_dirty(0);
+  blocks_mark_dirty(INODE_BLOCK);
+}
+
+// Make the block bitmap match the blocks actually claimed.
+static void fix_block_bitmap()
+{
+  void *bbm = get_blocks_bitmap();
+  for (int bnum = 0; bnum < blocks_count(); bnum++)
+  {
+    int used = bnum == 0 || bnum == INODE_BLOCK ||
+               atomic_load(&owner[bnum]) != -1;
+    bitmap_put(bbm, bnum, used);
+  }
+  blocks_mark_dirty(0);
+}
+
+// Compare the superblock's free counters with the bitmaps.
+static void check_counters()
+{
+  superblock_t *sb = get_superblock();
+  void *bbm = get_blocks_bitmap();
+  void *ibm = get_inode_bitmap();
+  int bad = 0;
+
+  u_int32_t free_blocks = 0;
+  for (int gg = 0; gg < blocks_group_count(); gg++)
+  {
+    int group_free = 0;
+    int end = (gg + 1) * BLOCKS_PER_GROUP;
+    end = end < blocks_count() ? end : blocks_count();
+    for (int ii = gg * BLOCKS_PER_GROUP; ii < end; ii++)
+    {
+      group_free += !bitmap_get(bbm, ii);
+    }
+    bad |= group_free != sb->group_free[gg];
+    free_blocks += group_free;
+  }
+  u_int32_t free_inodes = 0;
+  for (int ii = 0; ii < INODE_COUNT; ii++)
+  {
+    free_inodes += !bitmap_get(ibm, ii);
+  }
+
+  if (bad || free_blocks != sb->free_blocks || free_inodes != sb->free_inodes)
+  {
+    report(1, "free counters say %u blocks and %u inodes, bitmaps say %u and %u",
+           sb->free_blocks, sb->free_inodes, free_blocks, free_inodes);
+    if (repair)
+    {
+      super_recount();
+    }
+  }
+}
+
+// Check that every image file is there and can be opened as it will be:
+// loading one that is not would create it, or abort.
+static int images_exist(const char *image_path)
+{
+  char *paths = strdup(image_path);
+  char *save = NULL;
+  int ok = 1;
+  for (char *path = strtok_r(paths, ",", &save); path != NULL && ok;
+       path = strtok_r(NULL, ",", &save))
+  {
+    if (access(path, repair ? R_OK | W_OK : R_OK) != 0)
+    {
+      fprintf(stderr, "fsck.nufs: %s: %s\n", path, strerror(errno));
+      ok = 0;
+    }
+  }
+  free(paths);
+  return ok;
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: fsck.nufs [-n | -y] [-f] [-j threads] "
+                  "image[,image...]\n");
+  exit(FSCK_ERROR);
+}
+
+int main(int argc, char *argv[])
+{
+  int force = 0;
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "nyfj:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      repair = 0;
+      break;
+    case 'y':
+      repair = 1;
+      break;
+    case 'f':
+      force = 1;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1 || nthreads < 1)
+  {
+    usage();
+  }
+  const char *image_path = argv[optind];
+
+  if (!images_exist(image_path))
+  {
+    return FSCK_ERROR;
+  }
+  if (!super_load(image_path, BLOCKS_STRIPE_UNIT, repair ? 0 : BLOCKS_RDONLY))
+  {
+    fprintf(stderr, "fsck.nufs: %s has no nufs superblock\n", image_path);
+    return FSCK_ERROR;
+  }
+  superblock_t *sb = get_superblock();
+  if (sb->state == SUPER_CLEAN && !force)
+  {
+    printf("%s: clean\n", image_path);
+    blocks_free();
+    return FSCK_OK;
+  }
+
+  for (int i = 0; i < blocks_count(); i++)
+  {
+    atomic_init(&owner[i], -1);
+  }
+  for (int i = 0; i < INODE_COUNT; i++)
+  {
+    atomic_init(&links[i], 0);
+    atomic_init(&reached[i], 0);
+  }
+
+  if (repair)
+  {
+    // so an incremental export picks up the repairs
+    super_track_changes();
+  }
+  claim_csum_blocks();
+  run_parallel(claim_blocks, INODE_COUNT);
+
+  int root = get_inum_from_block(blocks_get_block(ROOT_BLOCK));
+  if (!inode_allocated(root) || get_inode(root)->mode != DIRECTORY_MODE)
+  {
+    fprintf(stderr, "fsck.nufs: %s: root directory is missing\n", image_path);
+    blocks_free();
+    return FSCK_UNCORRECTED;
+  }
+  atomic_store(&reached[root], 1);
+  frontier[0] = root;
+  frontier_count = 1;
+  while (frontier_count > 0)
+  {
+    atomic_store(&next_count, 0);
+    run_parallel(walk_level, frontier_count);
+    frontier_count = atomic_load(&next_count);
+    memcpy(frontier, next_frontier, frontier_count * sizeof(int));
+  }
+
+  run_parallel(check_inodes, INODE_COUNT);
+  if (repair)
+  {
+    // releases the blocks of unreachable inodes, so the bitmap check below
+    // reports them as leaked and fix_block_bitmap frees them
+    fix_inodes();
+  }
+  run_parallel(check_bitmap, blocks_count());
+  if (repair)
+  {
+    fix_block_bitmap();
+  }
+  check_counters();
+
+  int fixed = atomic_load(&corrected);
+  int left = atomic_load(&uncorrected);
+  if (fixed > 0)
+  {
+    // the repairs are not reflected in the directory usage totals
+    sb->usage_valid = 0;
+    blocks_mark_dirty(0);
+  }
+  if (repair && left == 0)
+  {
+    if (sb->state != SUPER_CLEAN)
+    {
+      // blocks written back before the crash may not match their
+      // checksums; the next mount recomputes them
+      sb->csum_valid = 0;
+    }
+    sb->state = SUPER_CLEAN;
+    blocks_mark_dirty(0);
+  }
+  blocks_free();
+
+  printf("%s: %d problems corrected, %d left (%d threads)\n", image_path,
+         fixed, left, nthreads);
+  if (left > 0)
+  {
+    return FSCK_UNCORRECTED;
+  }
+  return fixed > 0 ? FSCK_CORRECTED : FSCK_OK;
+}
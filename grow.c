@@ -0,0 +1,52 @@
+/**
+ * @file grow.c
+ *
+ * grow.nufs: grow a mounted nufs volume.
+ *
+ * Usage: grow.nufs mountpoint blocks
+ *
+ * The image files are extended and the new blocks become free straight
+ * away; nothing needs to be unmounted.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "nufs_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc != 3)
+  {
+    fprintf(stderr, "usage: grow.nufs mountpoint blocks\n");
+    return 1;
+  }
+  u_int32_t count = strtoul(argv[2], NULL, 0);
+  if (count == 0 || count > BLOCKS_MAX_COUNT)
+  {
+    fprintf(stderr, "grow.nufs: size must be 1 to %d blocks\n",
+            BLOCKS_MAX_COUNT);
+    return 1;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd == -1)
+  {
+    fprintf(stderr, "grow.nufs: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  if (ioctl(fd, NUFS_IOC_GROW, &count) == -1)
+  {
+    fprintf(stderr, "grow.nufs: %s: %s\n", argv[1], strerror(errno));
+    close(fd);
+    return 1;
+  }
+  close(fd);
+  printf("%s: grown to %u blocks\n", argv[1], count);
+  return 0;
+}
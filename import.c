@@ -0,0 +1,200 @@
+/**
+ * @file import.c
+ *
+ * import.nufs: rebuild a nufs image from the output of export.nufs.
+ *
+ * Usage: import.nufs [-i file] image[,image...]
+ *
+ * The stream is read from the file, or from stdin, and checked in full
+ * before anything is written. A full export creates a new, sparse image. An
+ * incremental one (export.nufs -s) is applied to an existing image, which
+ * must be at the generation the export was taken since; blocks it no longer
+ * uses are punched out of the image files.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "stream.h"
+#include "super.h"
+
+static void usage()
+{
+  fprintf(stderr, "usage: import.nufs [-i file] image[,image...]\n");
+  exit(1);
+}
+
+// Check whether any of the image files exist.
+static int images_exist(const char *image_path)
+{
+  char *paths = strdup(image_path);
+  int exist = 0;
+  for (char *p = strtok(paths, ","); p != NULL; p = strtok(NULL, ","))
+  {
+    exist |= access(p, F_OK) == 0;
+  }
+  free(paths);
+  return exist;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *in_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'i':
+      in_path = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1)
+  {
+    usage();
+  }
+  const char *image_path = argv[optind];
+  const char *in_name = in_path ? in_path : "stdin";
+
+  FILE *in = in_path ? fopen(in_path, "r") : stdin;
+  if (in == NULL)
+  {
+    fprintf(stderr, "import.nufs: %s: %s\n", in_path, strerror(errno));
+    return 1;
+  }
+  stream_header_t hdr;
+  if (stream_read_header(in, &hdr) != 0 || hdr.block_count == 0 ||
+      hdr.block_count > BLOCKS_MAX_COUNT || hdr.ndevs == 0 ||
+      hdr.stripe_unit == 0)
+  {
+    fprintf(stderr, "import.nufs: %s is not a nufs export\n", in_name);
+    return 1;
+  }
+
+  // read and check the whole stream first, so a bad one changes nothing
+  char *blocks = calloc(hdr.block_count, BLOCK_SIZE);
+  u_int8_t present[BLOCK_BITMAP_SIZE] = {0};
+  static char data[STREAM_PACK_MAX];
+  stream_record_t rec;
+  int count = 0;
+  while (1)
+  {
+    if (stream_read_record(in, &rec, data) != 0)
+    {
+      fprintf(stderr, "import.nufs: %s is truncated or corrupt\n", in_name);
+      return 1;
+    }
+    if (rec.bnum == STREAM_END)
+    {
+      break;
+    }
+    char *block = blocks + (size_t)rec.bnum * BLOCK_SIZE;
+    if (rec.bnum >= hdr.block_count ||
+        (rec.flags == STREAM_PACKED && stream_unpack(data, rec.len, block) != 0) ||
+        (rec.flags == 0 && rec.len != BLOCK_SIZE) ||
+        (rec.flags == STREAM_ZERO && rec.len != 0) ||
+        rec.flags > STREAM_PACKED)
+    {
+      fprintf(stderr, "import.nufs: %s: bad record for block %u\n", in_name,
+              rec.bnum);
+      return 1;
+    }
+    if (rec.flags == 0)
+    {
+      memcpy(block, data, BLOCK_SIZE);
+    }
+    bitmap_put(present, rec.bnum, 1);
+    count++;
+  }
+  if (!bitmap_get(present, 0))
+  {
+    fprintf(stderr, "import.nufs: %s has no block 0\n", in_name);
+    return 1;
+  }
+
+  // blocks the image no longer uses are handed back to the host
+  int flags = BLOCKS_DISCARD;
+  if (hdr.since == 0)
+  {
+    if (images_exist(image_path))
+    {
+      fprintf(stderr, "import.nufs: %s already exists\n", image_path);
+      return 1;
+    }
+    blocks_init(image_path, hdr.stripe_unit, flags);
+  }
+  else
+  {
+    if (!images_exist(image_path) ||
+        !super_load(image_path, hdr.stripe_unit, flags))
+    {
+      fprintf(stderr, "import.nufs: %s: no image to apply the changes to\n",
+              image_path);
+      return 1;
+    }
+    superblock_t *sb = get_superblock();
+    if (sb->state != SUPER_CLEAN || sb->generation != hdr.since)
+    {
+      fprintf(stderr, "import.nufs: %s is at generation %u%s, the changes "
+                      "are since %u\n",
+              image_path, sb->generation,
+              sb->state != SUPER_CLEAN ? " and not clean" : "", hdr.since);
+      blocks_free();
+      return 1;
+    }
+  }
+  if (blocks_device_count() != hdr.ndevs)
+  {
+    fprintf(stderr, "import.nufs: the export is of %u image files, got %d\n",
+            hdr.ndevs, blocks_device_count());
+    blocks_free();
+    return 1;
+  }
+  if (hdr.block_count > blocks_count())
+  {
+    int rv = blocks_grow(hdr.block_count);
+    if (rv != 0)
+    {
+      fprintf(stderr, "import.nufs: %s: %s\n", image_path, strerror(-rv));
+      blocks_free();
+      return 1;
+    }
+  }
+
+  for (int bnum = 0; bnum < hdr.block_count; bnum++)
+  {
+    if (bitmap_get(present, bnum))
+    {
+      memcpy(blocks_get_block(bnum), blocks + (size_t)bnum * BLOCK_SIZE,
+             BLOCK_SIZE);
+      blocks_mark_dirty(bnum);
+    }
+  }
+  int rv = blocks_sync();
+  if (rv == 0)
+  {
+    // the bitmap that says they are free is on disk now
+    blocks_discard_all();
+    rv = blocks_sync();
+    blocks_discard(BLOCKS_MAX_COUNT);
+  }
+  blocks_free();
+  free(blocks);
+
+  if (rv != 0)
+  {
+    fprintf(stderr, "import.nufs: %s: %s\n", image_path, strerror(-rv));
+    return 1;
+  }
+  fprintf(stderr, "%s: generation %u, %d blocks imported\n", image_path,
+          hdr.generation, count);
+  return 0;
+}
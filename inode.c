@@ -1,9 +1,26 @@
 #include <assert.h>
+#include <string.h>
 
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "super.h"
+#include "append.h"
+#include "dedup.h"
+#include "frag.h"
+#include "usage.h"
 
+// Timestamp updates held in memory until the next sync, so that reads and
+// small writes don't dirty the inode table block every time.
+typedef struct inode_times {
+  int dirty;
+  time_t dirtied; // when the entry first went dirty
+  u_int32_t atime;
+  u_int32_t mtime;
+  u_int32_t ctime;
+} inode_times_t;
+
+static inode_times_t inode_times[INODE_COUNT];
 
 // Print all recorded info about a given inode
 void print_inode(inode_t *node)
@@ -14,13 +31,19 @@ void print_inode(inode_t *node)
          "size: %d\n"
          "blocks: %d\n"
          "iblock: %d\n"
-         "iiblock: %d\n",
+         "tail: %u\n"
+         "atime: %u\n"
+         "mtime: %u\n"
+         "ctime: %u\n",
          node->mode,
          node->ref_count,
          node->size,
          node->block,
          node->iblock,
-         node->iiblock);
+         node->tail,
+         node->atime,
+         node->mtime,
+         node->ctime);
 }
 
 // return the inode of the given inum
@@ -40,17 +63,27 @@ int alloc_inode(mode_t mode)
   {
     if (!bitmap_get(ibm, ii))
     {
+      int block = alloc_block();
+      if (block == -1)
+      { // no room for its first block
+        return -1;
+      }
       bitmap_put(ibm, ii, 1);
+      get_superblock()->free_inodes--;
+      blocks_mark_dirty(0);
       printf("+ alloc_inode() -> %d\n", ii);
 
       inode_t *inode = get_inode(ii);
       inode->mode = mode;
       inode->ref_count = 0;
       inode->size = 0;
-      inode->block = alloc_block();
+      inode->block = block;
       // 0 means no storage block since it is the bitmap
       inode->iblock = 0;
-      inode->iiblock = 0;
+      inode->tail = 0;
+      inode->atime = inode->mtime = inode->ctime = time(NULL);
+      inode_times[ii].dirty = 0;
+      blocks_mark_dirty(INODE_BLOCK);
       return ii;
     }
   }
@@ -62,22 +95,52 @@ int alloc_inode(mode_t mode)
 void free_inode(int inum)
 {
   inode_t *inode = get_inode(inum);
-  // assumption about no Extra Credit (max file size 4k)
-  assert(inode->iblock == 0);
-  assert(inode->iiblock == 0);
-  free_block(inode->block);
+  append_forget(inum);
+  usage_forget(inum);
+  frag_free(inode);
+  shrink_inode(inode, inode->size);
+  if (inode->block != 0)
+  {
+    free_block(inode->block & ~INODE_UNWRITTEN);
+    inode->block = 0;
+  }
+  inode_times[inum].dirty = 0;
+  bitmap_put(get_inode_bitmap(), inum, 0);
+  get_superblock()->free_inodes++;
+  blocks_mark_dirty(0);
 }
 
-// grow the size of the given inode by the given amount
+// grow the size of the given inode by the given amount, leaving a hole
+// that reads back as zeros; returns the new size or -1 if it is too large
+// (or the disk is full)
 int grow_inode(inode_t *node, int size)
 {
-  // no Extra Credit, can't grow inode above one block 
-  assert(node->size + size <= BLOCK_SIZE);
+  if ((long)node->size + size > INODE_MAX_SIZE)
+  {
+    return -1;
+  }
+  // the bytes past the end of the file in its last block are stale, zero
+  // them before they become part of the file; that includes all of a block
+  // it has no bytes in yet, such as the first block of an empty file
+  int pos = node->size % BLOCK_SIZE;
+  int fbnum = node->size / BLOCK_SIZE;
+  if (inode_get_bnum(node, fbnum) != 0 && !inode_unwritten(node, fbnum))
+  {
+    int bnum = inode_write_bnum(node, fbnum);
+    if (bnum == -1)
+    { // a shared block could not be copied
+      return -1;
+    }
+    memset((char *)blocks_get_block(bnum) + pos, 0, BLOCK_SIZE - pos);
+    blocks_mark_dirty(bnum);
+  }
   node->size += size;
+  blocks_mark_dirty(INODE_BLOCK);
   return node->size;
 }
 
-// shrink the size of the given inode by the given amount
+// shrink the size of the given inode by the given amount, freeing the blocks
+// past the new end; the first block is always kept
 int shrink_inode(inode_t *node, int size)
 {
   if (node->size - size >= 0)
@@ -88,5 +151,274 @@ int shrink_inode(inode_t *node, int size)
   {
     node->size = 0;
   }
+
+  if (node->iblock != 0)
+  {
+    u_int32_t *ptrs = blocks_get_block(node->iblock);
+    int keep = bytes_to_blocks(node->size);
+    int mapped = 0;
+    for (int ii = 0; ii < INODE_PTRS; ++ii)
+    {
+      if (ptrs[ii] != 0 && ii + 1 >= keep)
+      {
+        free_block(ptrs[ii] & ~INODE_UNWRITTEN);
+        ptrs[ii] = 0;
+      }
+      mapped |= ptrs[ii];
+    }
+    blocks_mark_dirty(node->iblock);
+    if (!mapped)
+    {
+      free_block(node->iblock);
+      node->iblock = 0;
+    }
+  }
+  blocks_mark_dirty(INODE_BLOCK);
   return node->size;
 }
+
+// return the pointer to the given block of the file, flags included
+static u_int32_t get_ptr(inode_t *node, int fbnum)
+{
+  if (fbnum == 0)
+  {
+    return node->block;
+  }
+  if (fbnum >= INODE_MAX_BLOCKS || node->iblock == 0)
+  {
+    return 0;
+  }
+  u_int32_t *ptrs = blocks_get_block(node->iblock);
+  return ptrs[fbnum - 1];
+}
+
+// return the block holding the given block of the file, or 0 if it has none
+int inode_get_bnum(inode_t *node, int fbnum)
+{
+  return get_ptr(node, fbnum) & ~INODE_UNWRITTEN;
+}
+
+// check whether the given block of the file was allocated but never written
+int inode_unwritten(inode_t *node, int fbnum)
+{
+  return (get_ptr(node, fbnum) & INODE_UNWRITTEN) != 0;
+}
+
+// make the given block of the file live in block bnum, allocating the
+// indirect block if needed; returns 0, or -1 if there is no room
+int inode_set_bnum(inode_t *node, int fbnum, u_int32_t bnum)
+{
+  if (fbnum == 0)
+  {
+    node->block = bnum;
+    blocks_mark_dirty(INODE_BLOCK);
+    return 0;
+  }
+  if (fbnum >= INODE_MAX_BLOCKS)
+  {
+    return -1;
+  }
+  if (node->iblock == 0)
+  {
+    int iblock = alloc_block();
+    if (iblock == -1)
+    {
+      return -1;
+    }
+    memset(blocks_get_block(iblock), 0, BLOCK_SIZE);
+    node->iblock = iblock;
+    blocks_mark_dirty(INODE_BLOCK);
+  }
+  u_int32_t *ptrs = blocks_get_block(node->iblock);
+  ptrs[fbnum - 1] = bnum;
+  blocks_mark_dirty(node->iblock);
+  return 0;
+}
+
+// free the indirect block if it no longer names any block
+void inode_drop_iblock(inode_t *node)
+{
+  if (node->iblock == 0)
+  {
+    return;
+  }
+  u_int32_t *ptrs = blocks_get_block(node->iblock);
+  for (int ii = 0; ii < INODE_PTRS; ii++)
+  {
+    if (ptrs[ii] != 0)
+    {
+      return;
+    }
+  }
+  free_block(node->iblock);
+  node->iblock = 0;
+  blocks_mark_dirty(INODE_BLOCK);
+}
+
+// allocate a block for the given block of the file, next to the one before
+// it if possible; it is zeroed, or if unwritten is set left as it is and
+// flagged as reading back as zeros. Returns the block number or -1 if the
+// disk is full
+int inode_alloc_bnum(inode_t *node, int fbnum, int unwritten)
+{
+  // set up the indirect block first, so it does not land between data blocks
+  if (inode_set_bnum(node, fbnum, 0) == -1)
+  {
+    return -1;
+  }
+  int prev = fbnum > 0 ? inode_get_bnum(node, fbnum - 1) : 0;
+  int bnum = alloc_block_near(prev + 1);
+  if (bnum == -1)
+  {
+    return -1;
+  }
+  if (inode_set_bnum(node, fbnum, unwritten ? bnum | INODE_UNWRITTEN : bnum) == -1)
+  {
+    free_block(bnum);
+    return -1;
+  }
+  if (!unwritten)
+  {
+    memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+    blocks_mark_dirty(bnum);
+  }
+  return bnum;
+}
+
+// give the given block of the file a copy of the shared block it names, so
+// it can be written without changing the other files; -1 if no room
+static int copy_bnum(inode_t *node, int fbnum, u_int32_t ptr)
+{
+  int old = ptr & ~INODE_UNWRITTEN;
+  int prev = fbnum > 0 ? inode_get_bnum(node, fbnum - 1) : 0;
+  int bnum = alloc_block_near(prev + 1);
+  if (bnum == -1)
+  {
+    return -1;
+  }
+  if (ptr & INODE_UNWRITTEN)
+  {
+    memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+  }
+  else
+  {
+    memcpy(blocks_get_block(bnum), blocks_get_block(old), BLOCK_SIZE);
+  }
+  blocks_mark_dirty(bnum);
+  inode_set_bnum(node, fbnum, bnum);
+  free_block(old);
+  return bnum;
+}
+
+// return the block to write the given block of the file into, allocating it
+// if it is a hole, copying it if it is shared and zeroing it if it was never
+// written; -1 if no room
+int inode_write_bnum(inode_t *node, int fbnum)
+{
+  u_int32_t ptr = get_ptr(node, fbnum);
+  if (ptr == 0)
+  {
+    return inode_alloc_bnum(node, fbnum, 0);
+  }
+  int bnum = ptr & ~INODE_UNWRITTEN;
+  if (dedup_shared(bnum))
+  {
+    return copy_bnum(node, fbnum, ptr);
+  }
+  // what the index knows of it is about to be out of date
+  dedup_forget(bnum);
+  if (ptr & INODE_UNWRITTEN)
+  {
+    memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+    blocks_mark_dirty(bnum);
+    inode_set_bnum(node, fbnum, bnum);
+  }
+  return bnum;
+}
+
+// write the given inode's cached timestamps into the inode table
+static void write_times(int inum)
+{
+  inode_t *inode = get_inode(inum);
+  inode->atime = inode_times[inum].atime;
+  inode->mtime = inode_times[inum].mtime;
+  inode->ctime = inode_times[inum].ctime;
+  inode_times[inum].dirty = 0;
+  blocks_mark_dirty(INODE_BLOCK);
+}
+
+// set the given timestamps of an inode to now, in memory only
+void inode_touch(int inum, int which)
+{
+  inode_times_t *t = &inode_times[inum];
+  time_t now = time(NULL);
+  if (!t->dirty)
+  {
+    inode_t *inode = get_inode(inum);
+    t->atime = inode->atime;
+    t->mtime = inode->mtime;
+    t->ctime = inode->ctime;
+  }
+
+  // relatime: only move atime forward if it is older than the last change,
+  // or more than a day old
+  int changed = 0;
+  if ((which & INODE_ATIME) &&
+      (t->atime <= t->mtime || t->atime <= t->ctime ||
+       now - t->atime >= LAZYTIME_MAX_AGE))
+  {
+    t->atime = now;
+    changed = 1;
+  }
+  if (which & INODE_MTIME)
+  {
+    t->mtime = now;
+    changed = 1;
+  }
+  if (which & INODE_CTIME)
+  {
+    t->ctime = now;
+    changed = 1;
+  }
+
+  if (changed && !t->dirty)
+  {
+    t->dirty = 1;
+    t->dirtied = now;
+  }
+  if (t->dirty && now - t->dirtied >= LAZYTIME_MAX_AGE)
+  {
+    write_times(inum);
+  }
+}
+
+// explicitly set the access and modification times, e.g. for utimens
+void inode_set_times(int inum, time_t atime, time_t mtime)
+{
+  inode_touch(inum, INODE_CTIME);
+  inode_times[inum].atime = atime;
+  inode_times[inum].mtime = mtime;
+  write_times(inum);
+}
+
+// get the current timestamps of an inode, including unflushed updates
+void inode_get_times(int inum, time_t *atime, time_t *mtime, time_t *ctime)
+{
+  inode_t *inode = get_inode(inum);
+  inode_times_t *t = &inode_times[inum];
+  *atime = t->dirty ? t->atime : inode->atime;
+  *mtime = t->dirty ? t->mtime : inode->mtime;
+  *ctime = t->dirty ? t->ctime : inode->ctime;
+}
+
+// write all cached timestamp updates into the inode table
+void inode_flush_times()
+{
+  for (int ii = 0; ii < INODE_COUNT; ++ii)
+  {
+    if (inode_times[ii].dirty)
+    {
+      write_times(ii);
+    }
+  }
+}
@@ -11,7 +11,24 @@
 #define INODE_COUNT 128
 #define INODE_BLOCK 1
 
+// which timestamps inode_touch updates
+#define INODE_ATIME 0x1
+#define INODE_MTIME 0x2
+#define INODE_CTIME 0x4
+// longest a timestamp update may stay in memory only (as with lazytime)
+#define LAZYTIME_MAX_AGE (24 * 60 * 60)
+
+// the first block of a file is named in the inode, the rest in its indirect
+// block; a block number of 0 means that part of the file is a hole
+#define INODE_PTRS (BLOCK_SIZE / sizeof(u_int32_t))
+#define INODE_MAX_BLOCKS (1 + INODE_PTRS)
+#define INODE_MAX_SIZE ((long)INODE_MAX_BLOCKS * BLOCK_SIZE)
+// set in a block pointer when the block was allocated but never written, so
+// it reads back as zeros
+#define INODE_UNWRITTEN 0x80000000u
+
 #include <sys/types.h>
+#include <time.h>
 #include "blocks.h"
 
 
@@ -19,10 +36,12 @@ typedef struct inode {
   u_int16_t mode;       // permission & type
 	u_int16_t ref_count;  // Number of references to the data refered to by this inode
 	u_int32_t size;       // Size of Data 
-	u_int32_t block;  
-	u_int32_t iblock;     // Used for file splitting - 
-	u_int32_t iiblock;
-  u_int16_t padding[6]; // Pad inode struct size to 32 bytes
+	u_int32_t block;      // first block of data
+	u_int32_t iblock;     // indirect block listing the rest of the blocks
+	u_int32_t tail;       // fragments holding the partial last block, see frag.h
+  u_int32_t atime;      // last access, seconds since the epoch
+  u_int32_t mtime;      // last data modification
+  u_int32_t ctime;      // last status change
 } inode_t;
 
 #define INODE_SIZE sizeof(inode_t)
@@ -33,5 +52,15 @@ int alloc_inode(mode_t mode);
 void free_inode(int inum);
 int grow_inode(inode_t *node, int size);
 int shrink_inode(inode_t *node, int size);
+int inode_get_bnum(inode_t *node, int fbnum);
+int inode_unwritten(inode_t *node, int fbnum);
+int inode_set_bnum(inode_t *node, int fbnum, u_int32_t bnum);
+void inode_drop_iblock(inode_t *node);
+int inode_alloc_bnum(inode_t *node, int fbnum, int unwritten);
+int inode_write_bnum(inode_t *node, int fbnum);
+void inode_touch(int inum, int which);
+void inode_set_times(int inum, time_t atime, time_t mtime);
+void inode_get_times(int inum, time_t *atime, time_t *mtime, time_t *ctime);
+void inode_flush_times();
 
 #endif
@@ -0,0 +1,62 @@
+/**
+ * @file ls.c
+ *
+ * ls.nufs: list directories of a mounted nufs volume in the manner of ls -l,
+ * fetching each one's entries and their attributes with a single ioctl
+ * rather than a lookup and a stat per name.
+ *
+ * Usage: ls.nufs dir...
+ *
+ * Prints the inode, mode, links, size, modification time and name of each
+ * entry.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: ls.nufs dir...\n");
+    return 1;
+  }
+  int rv = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    static struct nufs_bulkstat bulk;
+    int fd = open(argv[i], O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || ioctl(fd, NUFS_IOC_BULKSTAT, &bulk) == -1)
+    {
+      fprintf(stderr, "ls.nufs: %s: %s\n", argv[i], strerror(errno));
+      rv = 1;
+    }
+    else
+    {
+      if (argc > 2)
+      {
+        printf("%s:\n", argv[i]);
+      }
+      for (u_int32_t k = 0; k < bulk.count; k++)
+      {
+        struct nufs_stat *ns = &bulk.entries[k];
+        char when[32];
+        time_t mtime = ns->mtime;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+        printf("%u\t%06o\t%u\t%llu\t%s\t%s\n", ns->ino, ns->mode, ns->nlink,
+               (unsigned long long)ns->size, when, ns->name);
+      }
+    }
+    if (fd != -1)
+    {
+      close(fd);
+    }
+  }
+  return rv;
+}
@@ -0,0 +1,509 @@
+/**
+ * @file mkfs.c
+ *
+ * mkfs.nufs: create a nufs image, optionally filled with a copy of a
+ * directory tree on the host.
+ *
+ * Usage: mkfs.nufs [-b blocks] [-u stripe-unit] [-j threads] [--from dir]
+ *                  image[,image...]
+ *
+ * The storage layer is linked in directly rather than going through a mount,
+ * and the work is done in three phases:
+ *
+ *   1. the source tree is walked by several threads at once, each taking the
+ *      next directory off a shared queue, listing it and queueing the
+ *      directories it finds;
+ *   2. single-threaded, the image is grown to fit with room to spare, then
+ *      every directory and file gets its inode, directory entry and all of
+ *      its blocks; nothing else allocates meanwhile, so each file's blocks
+ *      form one run;
+ *   3. the file data is read by several threads at once straight into the
+ *      mapped image, one read per run of blocks, after which the files'
+ *      partial last blocks are packed into shared blocks (see frag.h).
+ *
+ * Everything reaches the disk in a single sync at the end.
+ *
+ * Only directories and regular files are copied. Hard links become separate
+ * files.
+ */
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "directory.h"
+#include "frag.h"
+#include "inode.h"
+#include "storage.h"
+
+typedef struct entry {
+  char *path;                 // on the host
+  char name[DIR_NAME_LENGTH]; // in its parent
+  int parent;                 // index of the parent's entry, -1 for the root
+  int is_dir;
+  off_t size;
+  time_t atime;
+  time_t mtime;
+  int inum;
+  int nblocks;
+  int *bnums; // blocks of a file, in order
+} entry_t;
+
+static int nthreads = 1;
+
+// the tree as found so far; a directory's entry always comes before the
+// entries of its children
+static entry_t *entries = 0;
+static int entry_count = 0;
+static int entry_cap = 0;
+
+// directories waiting to be listed, and how many are queued or being listed
+static int *dir_queue = 0;
+static int dir_head = 0;
+static int dir_tail = 0;
+static int dirs_pending = 0;
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+
+static atomic_int next_copy;
+static atomic_int failed;
+
+static void usage()
+{
+  fprintf(stderr, "usage: mkfs.nufs [-b blocks] [-u stripe-unit] [-j threads] "
+                  "[--from dir] image[,image...]\n");
+  exit(1);
+}
+
+// Append an entry to the tree, queueing it for listing if it is a directory.
+// Returns its index. Called with walk_lock held.
+static int add_entry(char *path, const char *name, int parent,
+                     const struct stat *st)
+{
+  if (entry_count == entry_cap)
+  {
+    entry_cap = entry_cap ? entry_cap * 2 : 64;
+    entries = realloc(entries, entry_cap * sizeof(entry_t));
+    dir_queue = realloc(dir_queue, entry_cap * sizeof(int));
+    assert(entries && dir_queue);
+  }
+  entry_t *ent = &entries[entry_count];
+  memset(ent, 0, sizeof(entry_t));
+  ent->path = path;
+  strcpy(ent->name, name);
+  ent->parent = parent;
+  ent->is_dir = S_ISDIR(st->st_mode);
+  ent->size = ent->is_dir ? 0 : st->st_size;
+  ent->atime = st->st_atime;
+  ent->mtime = st->st_mtime;
+  ent->inum = -1;
+  if (ent->is_dir)
+  {
+    dir_queue[dir_tail++] = entry_count;
+    dirs_pending++;
+    pthread_cond_signal(&walk_cond);
+  }
+  return entry_count++;
+}
+
+// List one directory of the source tree, adding what it contains.
+static void walk_dir(int index, const char *path)
+{
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+  {
+    fprintf(stderr, "mkfs.nufs: %s: %s\n", path, strerror(errno));
+    atomic_store(&failed, 1);
+    return;
+  }
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL)
+  {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+    {
+      continue;
+    }
+    char *child = malloc(strlen(path) + strlen(de->d_name) + 2);
+    sprintf(child, "%s/%s", path, de->d_name);
+    struct stat st;
+    if (lstat(child, &st) == -1)
+    {
+      fprintf(stderr, "mkfs.nufs: %s: %s\n", child, strerror(errno));
+      atomic_store(&failed, 1);
+      free(child);
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+    {
+      fprintf(stderr, "mkfs.nufs: %s: not a file or directory, skipped\n",
+              child);
+      free(child);
+      continue;
+    }
+    if (strlen(de->d_name) >= DIR_NAME_LENGTH)
+    {
+      fprintf(stderr, "mkfs.nufs: %s: name is too long\n", child);
+      atomic_store(&failed, 1);
+      free(child);
+      continue;
+    }
+    pthread_mutex_lock(&walk_lock);
+    add_entry(child, de->d_name, index, &st);
+    pthread_mutex_unlock(&walk_lock);
+  }
+  closedir(dir);
+}
+
+// Take directories off the queue and list them until none are left.
+static void *walk_worker(void *arg)
+{
+  pthread_mutex_lock(&walk_lock);
+  while (1)
+  {
+    while (dir_head == dir_tail && dirs_pending > 0)
+    {
+      pthread_cond_wait(&walk_cond, &walk_lock);
+    }
+    if (dirs_pending == 0)
+    {
+      break;
+    }
+    int index = dir_queue[dir_head++];
+    // entries may move when the array grows, the path does not
+    const char *path = entries[index].path;
+    pthread_mutex_unlock(&walk_lock);
+    walk_dir(index, path);
+    pthread_mutex_lock(&walk_lock);
+    if (--dirs_pending == 0)
+    {
+      pthread_cond_broadcast(&walk_cond);
+    }
+  }
+  pthread_mutex_unlock(&walk_lock);
+  return NULL;
+}
+
+// Walk the whole source tree; entry 0 is its root.
+static void walk_tree(const char *root)
+{
+  struct stat st;
+  if (stat(root, &st) == -1 || !S_ISDIR(st.st_mode))
+  {
+    fprintf(stderr, "mkfs.nufs: %s: not a directory\n", root);
+    exit(1);
+  }
+  add_entry(strdup(root), "", -1, &st);
+
+  pthread_t threads[nthreads];
+  for (int t = 0; t < nthreads; t++)
+  {
+    int rv = pthread_create(&threads[t], NULL, walk_worker, NULL);
+    assert(rv == 0);
+  }
+  for (int t = 0; t < nthreads; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+}
+
+// Remove a half-made image.
+static void remove_images(const char *image_path)
+{
+  char *paths = strdup(image_path);
+  for (char *p = strtok(paths, ","); p != NULL; p = strtok(NULL, ","))
+  {
+    unlink(p);
+  }
+  free(paths);
+}
+
+// Count the blocks the tree needs, including block 0, the inode table and
+// the indirect blocks.
+static long blocks_needed()
+{
+  long needed = 2;
+  for (int i = 0; i < entry_count; i++)
+  {
+    long nblocks = bytes_to_blocks(entries[i].size);
+    needed += nblocks > 1 ? nblocks + 1 : 1;
+  }
+  return needed;
+}
+
+// Give one entry its inode, directory entry and blocks.
+// Returns 0, or -1 if the image is full.
+static int place_entry(entry_t *ent)
+{
+  if (ent->parent == -1)
+  {
+    ent->inum = get_inum_from_block(blocks_get_block(ROOT_BLOCK));
+    inode_set_times(ent->inum, ent->atime, ent->mtime);
+    return 0;
+  }
+  int parent = entries[ent->parent].inum;
+  ent->inum = alloc_inode(ent->is_dir ? DIRECTORY_MODE : FILE_MODE);
+  if (ent->inum == -1)
+  {
+    fprintf(stderr, "mkfs.nufs: %s: out of inodes or blocks\n", ent->path);
+    return -1;
+  }
+  inode_t *node = get_inode(ent->inum);
+  if (directory_put(get_inode(parent), ent->name, ent->inum) == -1)
+  {
+    fprintf(stderr, "mkfs.nufs: %s: too many entries in its directory\n",
+            ent->path);
+    return -1;
+  }
+  if (ent->is_dir)
+  {
+    directory_init(node);
+    directory_put(node, ".", ent->inum);
+    directory_put(node, "..", parent);
+  }
+  else
+  {
+    if (ent->size > INODE_MAX_SIZE)
+    {
+      fprintf(stderr, "mkfs.nufs: %s: file is too large\n", ent->path);
+      return -1;
+    }
+    grow_inode(node, ent->size);
+    ent->nblocks = bytes_to_blocks(ent->size);
+    ent->bnums = malloc((ent->nblocks + 1) * sizeof(int));
+    ent->bnums[0] = node->block;
+    blocks_mark_dirty(node->block);
+    for (int fbnum = 1; fbnum < ent->nblocks; fbnum++)
+    {
+      // left unzeroed, since the copy overwrites it
+      int bnum = inode_alloc_bnum(node, fbnum, 1);
+      if (bnum == -1)
+      {
+        fprintf(stderr, "mkfs.nufs: %s: out of blocks\n", ent->path);
+        return -1;
+      }
+      inode_set_bnum(node, fbnum, bnum);
+      blocks_mark_dirty(bnum);
+      ent->bnums[fbnum] = bnum;
+    }
+  }
+  inode_set_times(ent->inum, ent->atime, ent->mtime);
+  return 0;
+}
+
+// Read one file into its blocks, one read per run of blocks that are
+// adjacent in memory. Returns 0 or -1.
+static int copy_file(entry_t *ent)
+{
+  int fd = open(ent->path, O_RDONLY);
+  if (fd == -1)
+  {
+    fprintf(stderr, "mkfs.nufs: %s: %s\n", ent->path, strerror(errno));
+    return -1;
+  }
+  int rv = 0;
+  for (int first = 0; first < ent->nblocks && rv == 0;)
+  {
+    char *start = blocks_get_block(ent->bnums[first]);
+    int last = first + 1;
+    while (last < ent->nblocks &&
+           blocks_get_block(ent->bnums[last]) == start + (long)(last - first) * BLOCK_SIZE)
+    {
+      last++;
+    }
+    off_t off = (off_t)first * BLOCK_SIZE;
+    off_t end = (off_t)last * BLOCK_SIZE < ent->size ? (off_t)last * BLOCK_SIZE
+                                                     : ent->size;
+    while (off < end)
+    {
+      ssize_t got = pread(fd, start + (off - (off_t)first * BLOCK_SIZE),
+                          end - off, off);
+      if (got <= 0)
+      {
+        // an error, or the file shrank since it was listed
+        fprintf(stderr, "mkfs.nufs: %s: %s\n", ent->path,
+                got == 0 ? "file changed while copying" : strerror(errno));
+        rv = -1;
+        break;
+      }
+      off += got;
+    }
+    first = last;
+  }
+  close(fd);
+  return rv;
+}
+
+// Copy files until there are none left.
+static void *copy_worker(void *arg)
+{
+  int i;
+  while ((i = atomic_fetch_add(&next_copy, 1)) < entry_count)
+  {
+    if (!entries[i].is_dir && copy_file(&entries[i]) == -1)
+    {
+      atomic_store(&failed, 1);
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  static struct option long_opts[] = {
+      {"from", required_argument, 0, 'f'},
+      {0, 0, 0, 0},
+  };
+  const char *from = NULL;
+  long count = 0;
+  int stripe_unit = BLOCKS_STRIPE_UNIT;
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:u:j:", long_opts, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      count = strtol(optarg, NULL, 0);
+      break;
+    case 'u':
+      stripe_unit = atoi(optarg);
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    case 'f':
+      from = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1 || nthreads < 1 || stripe_unit < 1 || count < 0 ||
+      count > BLOCKS_MAX_COUNT)
+  {
+    usage();
+  }
+  const char *image_path = argv[optind];
+
+  // never format over an existing image
+  char *paths = strdup(image_path);
+  for (char *p = strtok(paths, ","); p != NULL; p = strtok(NULL, ","))
+  {
+    if (access(p, F_OK) == 0)
+    {
+      fprintf(stderr, "mkfs.nufs: %s already exists\n", p);
+      return 1;
+    }
+  }
+  free(paths);
+
+  atomic_init(&failed, 0);
+  if (from != NULL)
+  {
+    walk_tree(from);
+    if (atomic_load(&failed))
+    {
+      return 1;
+    }
+    long needed = blocks_needed();
+    if (needed > BLOCKS_MAX_COUNT || entry_count > INODE_COUNT)
+    {
+      fprintf(stderr, "mkfs.nufs: %s needs %ld blocks and %d inodes, "
+                      "an image holds at most %d and %d\n",
+              from, needed, entry_count, BLOCKS_MAX_COUNT, INODE_COUNT);
+      return 1;
+    }
+    // with a quarter to spare, so the image is not full from the start
+    long size = needed + needed / 4;
+    size = size < BLOCKS_MAX_COUNT ? size : BLOCKS_MAX_COUNT;
+    if (count == 0 && size > BLOCK_COUNT)
+    {
+      count = size;
+    }
+  }
+
+  // a fresh image is mapped, so the copy can go straight into it
+  storage_init(image_path, stripe_unit, 0);
+  if (count > blocks_count())
+  {
+    int rv = storage_grow(count);
+    if (rv != 0)
+    {
+      fprintf(stderr, "mkfs.nufs: %s: %s\n", image_path, strerror(-rv));
+      storage_free();
+      remove_images(image_path);
+      return 1;
+    }
+  }
+
+  int files = 0;
+  int dirs = 0;
+  for (int i = 0; i < entry_count; i++)
+  {
+    if (place_entry(&entries[i]) == -1)
+    {
+      storage_free();
+      remove_images(image_path);
+      return 1;
+    }
+    if (entries[i].is_dir)
+    {
+      dirs++;
+    }
+    else
+    {
+      files++;
+    }
+  }
+
+  atomic_init(&next_copy, 0);
+  pthread_t threads[nthreads];
+  for (int t = 0; t < nthreads; t++)
+  {
+    int rv = pthread_create(&threads[t], NULL, copy_worker, NULL);
+    assert(rv == 0);
+  }
+  for (int t = 0; t < nthreads; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+
+  // now that the data is in, pack the files' partial last blocks
+  for (int i = 0; i < entry_count; i++)
+  {
+    if (!entries[i].is_dir)
+    {
+      frag_pack(entries[i].inum);
+    }
+  }
+
+  if (storage_sync() != 0)
+  {
+    fprintf(stderr, "mkfs.nufs: %s: write failed\n", image_path);
+    atomic_store(&failed, 1);
+  }
+  int total = blocks_count();
+  storage_free();
+  if (atomic_load(&failed))
+  {
+    remove_images(image_path);
+    return 1;
+  }
+  printf("%s: %d blocks", image_path, total);
+  if (from != NULL)
+  {
+    printf(", %d files and %d directories from %s", files, dirs - 1, from);
+  }
+  printf("\n");
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include <bsd/string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -13,6 +14,12 @@
 #include "storage.h"
 #include "inode.h"
 #include "directory.h"
+#include "orphan.h"
+#include "discard.h"
+#include "defrag.h"
+#include "dedup.h"
+#include "nufs_ioctl.h"
+#include "trace.h"
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
@@ -26,11 +33,67 @@
 // blocks 524288 bytes (128 blocks)
 #define BLOCK_START 12288
 
+// nufs specific mount options, given as -o name[,name...]
+struct nufs_config
+{
+  int io_uring;    // do block I/O through io_uring instead of mmap
+  int stripe_unit; // blocks per stripe unit when striping over several images
+  int discard;     // punch freed blocks out of the image files
+  int ro;          // never write to the image (also passed on to FUSE)
+  char *trace;     // record every operation to this file, see trace.h
+  int hot_meta;    // keep metadata blocks in memory
+  int dedup;       // share identical data blocks between files
+  int verify;      // check blocks against their checksums as they are read
+  int batch;       // cache nothing in the kernel, so NUFS_IOC_BATCH works
+  // how long the kernel caches attributes, names and missing names; only
+  // looked at here, FUSE is given them too
+  double attr_timeout;
+  double entry_timeout;
+  double negative_timeout;
+};
+
+struct nufs_config nufs_config = {.stripe_unit = BLOCKS_STRIPE_UNIT};
+
+// FUSE options we mount with unless told otherwise. The kernel sees the
+// changes made through the usual calls, so it can cache attributes and names
+// for a while, and can send large requests. It does not see those made by
+// NUFS_IOC_BATCH, which is refused unless all three timeouts are 0, as the
+// batch option sets them
+#define NUFS_DEFAULT_OPTS "-oattr_timeout=30,entry_timeout=30,negative_timeout=5," \
+                          "big_writes,max_write=131072,max_read=131072"
+
+// FUSE options the batch option stands for, after the others so they win
+#define NUFS_BATCH_OPTS "-oattr_timeout=0,entry_timeout=0,negative_timeout=0"
+
+#define NUFS_OPT(t, p, v) {t, offsetof(struct nufs_config, p), v}
+
+static const struct fuse_opt nufs_opts[] = {
+    NUFS_OPT("io_uring", io_uring, 1),
+    NUFS_OPT("stripe_unit=%d", stripe_unit, 0),
+    NUFS_OPT("discard", discard, 1),
+    NUFS_OPT("ro", ro, 1),
+    NUFS_OPT("trace=%s", trace, 0),
+    NUFS_OPT("hot_meta", hot_meta, 1),
+    NUFS_OPT("dedup", dedup, 1),
+    NUFS_OPT("verify", verify, 1),
+    NUFS_OPT("batch", batch, 1),
+    NUFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    NUFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    NUFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    FUSE_OPT_KEY("ro", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("attr_timeout=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("entry_timeout=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("negative_timeout=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_END,
+};
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask)
 {
+  storage_lock();
   int inum = tree_lookup(path);
+  storage_unlock();
   // TODO: Mask? (can be read/written/executed?)
   printf("access(%s, %04o) -> %d\n", path, mask, inum);
   return inum != -1 ? 0 : -1;
@@ -41,7 +104,9 @@ int nufs_access(const char *path, int mask)
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st)
 {
+  storage_lock();
   int rv = storage_stat(path, st);
+  storage_unlock();
   printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
          st->st_size);
   return rv == 0 ? 0 : -ENOENT;
@@ -62,8 +127,9 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi)
 {
   struct stat st;
-  int rv;
+  int rv = 0;
 
+  storage_lock();
   int inum_dir = tree_lookup(path);
   inode_t *inode_dir = get_inode(inum_dir);
   slist_t *dir_entries = directory_list_path(path);
@@ -96,7 +162,7 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     rv = nufs_getattr(cur_path->data, &st);
     if (rv != 0)
     {
-      return rv;
+      break;
     }
     filler(buf, cur_name->data, &st, 0);
     cur_name = cur_name->next;
@@ -106,8 +172,9 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   s_free(dir_entries);
   s_free(entry_paths);
   free(full_path);
+  storage_unlock();
   printf("readdir(%s) -> %d\n", path, rv);
-  return 0;
+  return rv;
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -116,7 +183,9 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+  storage_lock();
   int inum = find_or_create(path, mode);
+  storage_unlock();
   int rv = inum != -1 ? 0 : -1;
   fprintf(stderr, "mknod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
@@ -126,42 +195,36 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode)
 {
-  int rv = nufs_mknod(path, DIRECTORY_MODE, 0);
-
-  int inum = tree_lookup(path);
-  inode_t *dir = get_inode(inum);
-  ((dirhead_t *)(blocks_get_block(get_inode(inum)->block)))->num_entries = 0;
-  directory_put(dir, ".", inum);
-
-  char **sp = split_path(path);
-  int inum_parent = tree_lookup(sp[0]);
-  inode_t *dir_parent = get_inode(inum_parent);
-  directory_put(dir, "..", inum_parent);
-  free(sp[0]);
-  free(sp[1]);
-  free(sp);
-
+  storage_lock();
+  int rv = storage_mkdir(path);
+  storage_unlock();
   printf("mkdir(%s) -> %d\n", path, rv);
   return rv;
 }
 
 int nufs_unlink(const char *path)
 {
+  storage_lock();
   int rv = storage_unlink(path);
+  storage_unlock();
   printf("unlink(%s) -> %d\n", path, rv);
   return rv;
 }
 
 int nufs_link(const char *from, const char *to)
 {
+  storage_lock();
   int rv = storage_link(from, to);
+  storage_unlock();
   printf("link(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
 
 int nufs_rmdir(const char *path)
 {
+  storage_lock();
   int rv = storage_unlink(path);
+  storage_unlock();
   printf("rmdir(%s) -> %d\n", path, rv);
   return rv;
 }
@@ -170,7 +233,9 @@ int nufs_rmdir(const char *path)
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to)
 {
+  storage_lock();
   int rv = storage_rename(from, to);
+  storage_unlock();
   printf("rename(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
@@ -184,28 +249,63 @@ int nufs_chmod(const char *path, mode_t mode)
 
 int nufs_truncate(const char *path, off_t size)
 {
+  storage_lock();
   int rv = storage_truncate(path, size);
+  storage_unlock();
   printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
   return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Preallocate space, punch a hole or zero a range without writing it out.
+// Implementation for: man 2 fallocate
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi)
+{
+  storage_lock();
+  int inum = fi != NULL ? (int)fi->fh : tree_lookup(path);
+  int rv = inum != -1 ? storage_fallocate(inum, mode, offset, length) : -ENOENT;
+  storage_unlock();
+  printf("fallocate(%s, %d, %ld bytes, @+%ld) -> %d\n", path, mode, length,
+         offset, rv);
+  return rv;
+}
+
+// This is called on open. The inum is kept as the file handle, so reads and
+// writes keep working if the file is renamed or unlinked while open. The
+// kernel keeps its cached pages unless the data changed behind its back.
 int nufs_open(const char *path, struct fuse_file_info *fi)
 {
-  int inum = tree_lookup(path);
-  int rv = inum != -1 ? 0 : -1;
+  storage_lock();
+  int inum = storage_open(path);
+  if (inum != -1)
+  {
+    fi->keep_cache = storage_keep_cache(inum);
+  }
+  storage_unlock();
+  int rv = inum != -1 ? 0 : -ENOENT;
+  fi->fh = inum;
   printf("open(%s) -> %d\n", path, rv);
   return rv;
 }
 
+// Called when the last file descriptor for an open file is closed.
+int nufs_release(const char *path, struct fuse_file_info *fi)
+{
+  storage_lock();
+  storage_release(fi->fh);
+  storage_unlock();
+  printf("release(%s) -> 0\n", path);
+  return 0;
+}
+
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi)
 {
-  int rv = storage_read(path, buf, size, offset);
+  storage_lock();
+  int rv = fi != NULL ? storage_read_inum(fi->fh, buf, size, offset)
+                      : storage_read(path, buf, size, offset);
+  storage_unlock();
   fprintf(stderr, "read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
@@ -214,25 +314,123 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi)
 {
-  int rv = storage_write(path, buf, size, offset);
+  storage_lock();
+  int rv = fi != NULL ? storage_write_inum(fi->fh, buf, size, offset)
+                      : storage_write(path, buf, size, offset);
+  storage_unlock();
   fprintf(stderr, "write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
 
+// Report free space and inodes.
+// Implementation for: man 2 statfs
+int nufs_statfs(const char *path, struct statvfs *st)
+{
+  storage_lock();
+  int rv = storage_statfs(st);
+  storage_unlock();
+  printf("statfs(%s) -> %d {free blocks: %lu, free inodes: %lu}\n", path, rv,
+         st->f_bfree, st->f_ffree);
+  return rv;
+}
+
+// Flush the file's data to the disk image.
+// Implementation for: man 2 fsync
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  storage_lock();
+  int rv = storage_sync();
+  storage_unlock();
+  printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+  return rv;
+}
+
+// Called once the filesystem is mounted, in the process that will serve it
+// (after FUSE has daemonized), so background threads are started here.
+void *nufs_init(struct fuse_conn_info *conn)
+{
+  // they all write to the image
+  if (!nufs_config.ro)
+  {
+    reclaim_start();
+    defrag_start();
+  }
+  if (nufs_config.discard && !nufs_config.ro)
+  {
+    discard_start();
+  }
+  printf("init()\n");
+  return NULL;
+}
+
+// Called on unmount; writes everything back and closes the disk image.
+void nufs_destroy(void *private_data)
+{
+  storage_free();
+  trace_close();
+  printf("destroy()\n");
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2])
 {
-  int rv = 0;
+  storage_lock();
+  int rv = storage_set_time(path, ts) == 0 ? 0 : -ENOENT;
+  storage_unlock();
   fprintf(stderr, "utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
           ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
   return rv;
 }
 
-// Extended operations
+// Extended operations, see nufs_ioctl.h
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data)
 {
-  int rv = 0;
+  int rv;
+  storage_lock();
+  switch ((unsigned int)cmd)
+  {
+  case NUFS_IOC_GROW:
+    rv = storage_grow(*(u_int32_t *)data);
+    break;
+  case NUFS_IOC_DEFRAG:
+    if (nufs_config.ro)
+    {
+      rv = -EROFS;
+      break;
+    }
+    defrag_request(*(u_int32_t *)data);
+    rv = 0;
+    break;
+  case NUFS_IOC_USAGE:
+    rv = storage_usage(path, data);
+    break;
+  case NUFS_IOC_BULKSTAT:
+    rv = storage_bulkstat(path, data);
+    break;
+  case NUFS_IOC_BATCH:
+    if (nufs_config.ro)
+    {
+      rv = -EROFS;
+      break;
+    }
+    if (nufs_config.attr_timeout != 0 || nufs_config.entry_timeout != 0 ||
+        nufs_config.negative_timeout != 0)
+    {
+      // the kernel would go on using what it cached of the names changed
+      rv = -EOPNOTSUPP;
+      break;
+    }
+    rv = storage_batch(path, data);
+    break;
+  case NUFS_IOC_DEDUP:
+    dedup_stats(data);
+    rv = 0;
+    break;
+  default:
+    rv = -ENOTTY;
+  }
+  storage_unlock();
   printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
   return rv;
 }
@@ -251,20 +449,247 @@ void nufs_init_ops(struct fuse_operations *ops)
   ops->rename = nufs_rename;
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
+  ops->fallocate = nufs_fallocate;
   ops->open = nufs_open;
+  ops->release = nufs_release;
   ops->read = nufs_read;
   ops->write = nufs_write;
   ops->utimens = nufs_utimens;
+  ops->statfs = nufs_statfs;
+  ops->fsync = nufs_fsync;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
   ops->ioctl = nufs_ioctl;
 };
 
+// With -o trace=FILE the operations below take the place of the ones above
+// and record each call on its way through, so untraced mounts pay nothing.
+
+static void nufs_trace(trace_op_t op, const char *path, const char *path2,
+                       u_int64_t start, int rv, struct fuse_file_info *fi,
+                       off_t offset, size_t size, int mode)
+{
+  trace_record_t rec = {.op = op,
+                        .result = rv,
+                        .fh = fi != NULL ? (u_int32_t)fi->fh : TRACE_NO_FH,
+                        .offset = offset,
+                        .size = size,
+                        .mode = mode};
+  trace_record(&rec, path, path2, start);
+}
+
+static int traced_access(const char *path, int mask)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_access(path, mask);
+  nufs_trace(TRACE_ACCESS, path, NULL, start, rv, NULL, 0, 0, mask);
+  return rv;
+}
+
+static int traced_getattr(const char *path, struct stat *st)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_getattr(path, st);
+  nufs_trace(TRACE_GETATTR, path, NULL, start, rv, NULL, 0, 0, 0);
+  return rv;
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_readdir(path, buf, filler, offset, fi);
+  nufs_trace(TRACE_READDIR, path, NULL, start, rv, NULL, 0, 0, 0);
+  return rv;
+}
+
+static int traced_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_mknod(path, mode, rdev);
+  nufs_trace(TRACE_MKNOD, path, NULL, start, rv, NULL, 0, 0, mode);
+  return rv;
+}
+
+static int traced_mkdir(const char *path, mode_t mode)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_mkdir(path, mode);
+  nufs_trace(TRACE_MKDIR, path, NULL, start, rv, NULL, 0, 0, mode);
+  return rv;
+}
+
+static int traced_unlink(const char *path)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_unlink(path);
+  nufs_trace(TRACE_UNLINK, path, NULL, start, rv, NULL, 0, 0, 0);
+  return rv;
+}
+
+static int traced_link(const char *from, const char *to)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_link(from, to);
+  nufs_trace(TRACE_LINK, from, to, start, rv, NULL, 0, 0, 0);
+  return rv;
+}
+
+static int traced_rmdir(const char *path)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_rmdir(path);
+  nufs_trace(TRACE_RMDIR, path, NULL, start, rv, NULL, 0, 0, 0);
+  return rv;
+}
+
+static int traced_rename(const char *from, const char *to)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_rename(from, to);
+  nufs_trace(TRACE_RENAME, from, to, start, rv, NULL, 0, 0, 0);
+  return rv;
+}
+
+static int traced_truncate(const char *path, off_t size)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_truncate(path, size);
+  nufs_trace(TRACE_TRUNCATE, path, NULL, start, rv, NULL, 0, size, 0);
+  return rv;
+}
+
+static int traced_fallocate(const char *path, int mode, off_t offset,
+                           off_t length, struct fuse_file_info *fi)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_fallocate(path, mode, offset, length, fi);
+  nufs_trace(TRACE_FALLOCATE, path, NULL, start, rv, fi, offset, length, mode);
+  return rv;
+}
+
+// the flags are kept as the mode, so a replay opens the file the same way
+static int traced_open(const char *path, struct fuse_file_info *fi)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_open(path, fi);
+  nufs_trace(TRACE_OPEN, path, NULL, start, rv, fi, 0, 0, fi->flags);
+  return rv;
+}
+
+static int traced_release(const char *path, struct fuse_file_info *fi)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_release(path, fi);
+  nufs_trace(TRACE_RELEASE, path, NULL, start, rv, fi, 0, 0, 0);
+  return rv;
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_read(path, buf, size, offset, fi);
+  nufs_trace(TRACE_READ, path, NULL, start, rv, fi, offset, size, 0);
+  return rv;
+}
+
+static int traced_write(const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_write(path, buf, size, offset, fi);
+  nufs_trace(TRACE_WRITE, path, NULL, start, rv, fi, offset, size, 0);
+  return rv;
+}
+
+static int traced_statfs(const char *path, struct statvfs *st)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_statfs(path, st);
+  nufs_trace(TRACE_STATFS, path, NULL, start, rv, NULL, 0, 0, 0);
+  return rv;
+}
+
+static int traced_fsync(const char *path, int datasync,
+                       struct fuse_file_info *fi)
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_fsync(path, datasync, fi);
+  nufs_trace(TRACE_FSYNC, path, NULL, start, rv, fi, 0, 0, datasync);
+  return rv;
+}
+
+static int traced_utimens(const char *path, const struct timespec ts[2])
+{
+  u_int64_t start = trace_now();
+  int rv = nufs_utimens(path, ts);
+  nufs_trace(TRACE_UTIMENS, path, NULL, start, rv, NULL, 0, 0, 0);
+  return rv;
+}
+
+void nufs_trace_ops(struct fuse_operations *ops)
+{
+  ops->access = traced_access;
+  ops->getattr = traced_getattr;
+  ops->readdir = traced_readdir;
+  ops->mknod = traced_mknod;
+  ops->mkdir = traced_mkdir;
+  ops->link = traced_link;
+  ops->unlink = traced_unlink;
+  ops->rmdir = traced_rmdir;
+  ops->rename = traced_rename;
+  ops->truncate = traced_truncate;
+  ops->fallocate = traced_fallocate;
+  ops->open = traced_open;
+  ops->release = traced_release;
+  ops->read = traced_read;
+  ops->write = traced_write;
+  ops->utimens = traced_utimens;
+  ops->statfs = traced_statfs;
+  ops->fsync = traced_fsync;
+}
+
 struct fuse_operations nufs_ops;
 
 int main(int argc, char *argv[])
 {
-  assert(argc > 2 && argc < 6);
+  assert(argc > 2);
   printf("Mounted %s as data file\n", argv[--argc]);
-  storage_init(argv[argc]);
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  // ahead of the command line options, so those win
+  int rv = fuse_opt_insert_arg(&args, 1, NUFS_DEFAULT_OPTS);
+  assert(rv == 0);
+  rv = fuse_opt_parse(&args, &nufs_config, nufs_opts, NULL);
+  assert(rv == 0);
+  if (nufs_config.batch)
+  {
+    rv = fuse_opt_add_arg(&args, NUFS_BATCH_OPTS);
+    assert(rv == 0);
+    nufs_config.attr_timeout = 0;
+    nufs_config.entry_timeout = 0;
+    nufs_config.negative_timeout = 0;
+  }
+  storage_init(argv[argc], nufs_config.stripe_unit,
+               (nufs_config.io_uring ? BLOCKS_URING : 0) |
+                   (nufs_config.discard ? BLOCKS_DISCARD : 0) |
+                   (nufs_config.ro ? BLOCKS_RDONLY : 0) |
+                   (nufs_config.hot_meta ? BLOCKS_HOT_META : 0) |
+                   (nufs_config.dedup ? BLOCKS_DEDUP : 0) |
+                   (nufs_config.verify ? BLOCKS_VERIFY : 0));
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  if (nufs_config.trace != NULL)
+  {
+    // opened before FUSE daemonizes, which changes to /
+    rv = trace_open(nufs_config.trace);
+    if (rv != 0)
+    {
+      fprintf(stderr, "nufs: %s: %s\n", nufs_config.trace, strerror(-rv));
+      return 1;
+    }
+    nufs_trace_ops(&nufs_ops);
+  }
+  rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+  fuse_opt_free_args(&args);
+  return rv;
 }
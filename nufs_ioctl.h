@@ -0,0 +1,114 @@
+/**
+ * @file nufs_ioctl.h
+ *
+ * ioctl commands understood by a mounted nufs. They can be issued on any
+ * file or directory inside the mount, including its root.
+ */
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+/**
+ * Grow the volume to the given number of blocks (a u_int32_t) without
+ * unmounting it. Fails with EINVAL if that is not larger than it is now, and
+ * with EFBIG if it is over the largest size an image can have.
+ */
+#define NUFS_IOC_GROW _IOW('N', 1, u_int32_t)
+
+/**
+ * Start a defragmentation pass in the background and return straight away.
+ * The argument (a u_int32_t) is the most blocks to move per second, or 0 to
+ * go as fast as possible.
+ */
+#define NUFS_IOC_DEFRAG _IOW('N', 2, u_int32_t)
+
+struct nufs_usage {
+  u_int64_t bytes;  // file sizes added up
+  u_int64_t blocks; // blocks held, data and metadata
+  u_int64_t files;  // files and directories
+};
+
+/**
+ * Get what is beneath a directory, all the way down, without walking it;
+ * or for a file, the file itself. A file with several links is counted
+ * under each of them.
+ */
+#define NUFS_IOC_USAGE _IOR('N', 3, struct nufs_usage)
+
+struct nufs_dedup {
+  u_int64_t referenced; // data blocks named by files
+  u_int64_t stored;     // distinct data blocks actually stored
+  u_int64_t shared;     // blocks named more than once
+  u_int64_t hits;       // blocks shared by writes since the mount
+};
+
+/**
+ * Get how much the volume saves by sharing identical blocks; referenced
+ * over stored is the dedup ratio. Blocks are only shared when mounted with
+ * -o dedup, but sharing from earlier mounts is always counted.
+ */
+#define NUFS_IOC_DEDUP _IOR('N', 4, struct nufs_dedup)
+
+#define NUFS_NAME_MAX 48  // bytes in a name, with its terminating NUL
+#define NUFS_BULK_MAX 64  // at least the entries a directory can hold
+
+struct nufs_stat {
+  char name[NUFS_NAME_MAX];
+  u_int32_t ino;
+  u_int32_t mode;
+  u_int32_t nlink;
+  u_int32_t _reserved;
+  u_int64_t size;
+  int64_t atime;
+  int64_t mtime;
+  int64_t ctime;
+};
+
+struct nufs_bulkstat {
+  u_int32_t count; // entries filled in
+  u_int32_t _reserved;
+  struct nufs_stat entries[NUFS_BULK_MAX];
+};
+
+/**
+ * Get every entry of a directory with what stat would report for it, in
+ * one call instead of one lookup and one getattr per name. Issued on the
+ * directory itself; "." and ".." are left out.
+ */
+#define NUFS_IOC_BULKSTAT _IOR('N', 5, struct nufs_bulkstat)
+
+#define NUFS_BATCH_CREATE 1 // a file, with the given mode
+#define NUFS_BATCH_MKDIR 2
+#define NUFS_BATCH_UNLINK 3 // a file or an empty directory
+
+struct nufs_batch_op {
+  u_int32_t op;     // NUFS_BATCH_*
+  u_int32_t mode;   // for NUFS_BATCH_CREATE
+  int32_t result;   // filled in: 0 or -errno
+  u_int32_t ino;    // filled in: the inode created
+  char name[NUFS_NAME_MAX];
+};
+
+struct nufs_batch {
+  u_int32_t count; // operations to apply
+  u_int32_t _reserved;
+  struct nufs_batch_op ops[NUFS_BULK_MAX];
+};
+
+/**
+ * Create and remove several names in one directory, the one the call is
+ * issued on, in order and as one operation: nothing else runs in between,
+ * and the directory is looked up once. Every operation is tried and gets
+ * its own result; the call itself only fails if the directory cannot be
+ * used at all.
+ *
+ * The kernel is not told about the names changed, so the call fails with
+ * EOPNOTSUPP unless the mount was made with attr_timeout, entry_timeout and
+ * negative_timeout all 0, when it caches nothing to go stale; -o batch
+ * sets them so.
+ */
+#define NUFS_IOC_BATCH _IOWR('N', 6, struct nufs_batch)
+
+#endif
@@ -0,0 +1,117 @@
+/**
+ * @file orphan.c
+ *
+ * Orphan list and background reclaimer implementation.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include "bitmap.h"
+#include "inode.h"
+#include "orphan.h"
+#include "storage.h"
+#include "super.h"
+
+static int open_count[INODE_COUNT]; // in memory only, nothing is open at mount
+
+static pthread_t reclaim_thread;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static int reclaim_running = 0;
+static int reclaim_stopping = 0;
+
+// Put an inode whose last link was removed on the orphan list.
+void orphan_add(int inum)
+{
+  bitmap_put(get_superblock()->orphans, inum, 1);
+  blocks_mark_dirty(0);
+  printf("+ orphan_add(%d)\n", inum);
+  pthread_cond_signal(&reclaim_cond);
+}
+
+// Check whether an inode is on the orphan list.
+int orphan_get(int inum) { return bitmap_get(get_superblock()->orphans, inum); }
+
+// Record that an inode was opened.
+void orphan_open(int inum) { open_count[inum]++; }
+
+// Record that an inode was closed.
+int orphan_close(int inum)
+{
+  assert(open_count[inum] > 0);
+  if (--open_count[inum] == 0 && orphan_get(inum))
+  {
+    pthread_cond_signal(&reclaim_cond);
+  }
+  return open_count[inum];
+}
+
+// Free up to max closed orphans.
+int reclaim_orphans(int max)
+{
+  void *orphans = get_superblock()->orphans;
+  int freed = 0;
+  for (int ii = 0; ii < INODE_COUNT && freed < max; ++ii)
+  {
+    if (bitmap_get(orphans, ii) && open_count[ii] == 0)
+    {
+      free_inode(ii);
+      bitmap_put(orphans, ii, 0);
+      blocks_mark_dirty(0);
+      freed++;
+    }
+  }
+  if (freed > 0)
+  {
+    printf("+ reclaim_orphans() -> %d\n", freed);
+  }
+  return freed;
+}
+
+// Reclaim orphans a batch at a time, dropping the lock in between so the
+// foreground is never held up for more than one batch, and sleep when there
+// is nothing left to do.
+static void *reclaim_main(void *arg)
+{
+  storage_lock();
+  while (!reclaim_stopping)
+  {
+    if (reclaim_orphans(RECLAIM_BATCH) > 0)
+    {
+      storage_unlock();
+      sched_yield();
+      storage_lock();
+    }
+    else
+    {
+      storage_wait(&reclaim_cond);
+    }
+  }
+  storage_unlock();
+  return NULL;
+}
+
+// Start the background reclaimer thread.
+void reclaim_start()
+{
+  reclaim_stopping = 0;
+  int rv = pthread_create(&reclaim_thread, NULL, reclaim_main, NULL);
+  assert(rv == 0);
+  reclaim_running = 1;
+}
+
+// Stop the background reclaimer thread and wait for it.
+void reclaim_stop()
+{
+  if (!reclaim_running)
+  {
+    return;
+  }
+  storage_lock();
+  reclaim_stopping = 1;
+  pthread_cond_signal(&reclaim_cond);
+  storage_unlock();
+  pthread_join(reclaim_thread, NULL);
+  reclaim_running = 0;
+}
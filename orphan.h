@@ -0,0 +1,70 @@
+/**
+ * @file orphan.h
+ *
+ * Deferred reclamation of unlinked inodes.
+ *
+ * When the last link to an inode goes away its storage is not freed on the
+ * spot. The inode goes on the orphan list in the superblock instead, and a
+ * background thread frees orphans in batches. Orphans that are still open
+ * are kept until they are closed. The list is persistent, so orphans left
+ * behind by a crash are reclaimed on the next mount.
+ */
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+#define RECLAIM_BATCH 16 // inodes freed per hold of the storage lock
+
+/**
+ * Put an inode whose last link was removed on the orphan list.
+ *
+ * @param inum The inode number.
+ */
+void orphan_add(int inum);
+
+/**
+ * Check whether an inode is on the orphan list.
+ *
+ * @param inum The inode number.
+ *
+ * @return 1 if it is an orphan, 0 if not.
+ */
+int orphan_get(int inum);
+
+/**
+ * Record that an inode was opened, keeping it alive if it becomes an orphan.
+ *
+ * @param inum The inode number.
+ */
+void orphan_open(int inum);
+
+/**
+ * Record that an inode was closed, reclaiming it later if it is an orphan
+ * and this was the last open.
+ *
+ * @param inum The inode number.
+ *
+ * @return Number of opens still outstanding.
+ */
+int orphan_close(int inum);
+
+/**
+ * Free up to the given number of closed orphans. Called with the storage
+ * lock held.
+ *
+ * @param max Most orphans to free.
+ *
+ * @return Number of orphans freed.
+ */
+int reclaim_orphans(int max);
+
+/**
+ * Start the background reclaimer thread.
+ */
+void reclaim_start();
+
+/**
+ * Stop the background reclaimer thread, if it is running, and wait for it.
+ */
+void reclaim_stop();
+
+#endif
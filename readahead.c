@@ -0,0 +1,95 @@
+/**
+ * @file readahead.c
+ *
+ * Implementation of the per-file readahead.
+ */
+#include <string.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "readahead.h"
+
+typedef struct readahead {
+  off_t next;  // where the last read ended
+  int streak;  // reads in a row that followed on (> 0) or did not (< 0)
+  int window;  // blocks read ahead last time, 0 for none yet
+  int ahead;   // file block readahead has been asked for up to
+  int random;  // the file's blocks were advised BLOCKS_ADVISE_RANDOM
+} readahead_t;
+
+static readahead_t readahead_state[INODE_COUNT];
+
+// Start watching a file afresh.
+void readahead_open(int inum)
+{
+  memset(&readahead_state[inum], 0, sizeof(readahead_t));
+}
+
+// Pass the given advice on for the file's blocks in [first, last).
+static void readahead_advise(inode_t *node, int first, int last,
+                             blocks_advice_t advice)
+{
+  int bnums[INODE_MAX_BLOCKS];
+  int count = 0;
+  for (int fbnum = first; fbnum < last; fbnum++)
+  {
+    int bnum = inode_get_bnum(node, fbnum);
+    if (bnum != 0 && !inode_unwritten(node, fbnum))
+    {
+      bnums[count++] = bnum;
+    }
+  }
+  blocks_advise(bnums, count, advice);
+}
+
+// Note a read of a file and read ahead or advise as its pattern calls for.
+void readahead_read(int inum, off_t offset, size_t size)
+{
+  readahead_t *ra = &readahead_state[inum];
+  inode_t *node = get_inode(inum);
+  int nblocks = bytes_to_blocks(node->size);
+  int last = (offset + size - 1) / BLOCK_SIZE;
+
+  if (offset == ra->next)
+  {
+    ra->streak = ra->streak > 0 ? ra->streak + 1 : 1;
+  }
+  else
+  {
+    ra->streak = ra->streak < 0 ? ra->streak - 1 : -1;
+    ra->window = 0;
+    ra->ahead = 0;
+  }
+  ra->next = offset + size;
+
+  if (ra->streak <= -READAHEAD_TRIGGER && !ra->random)
+  {
+    readahead_advise(node, 0, nblocks, BLOCKS_ADVISE_RANDOM);
+    ra->random = 1;
+  }
+  if (ra->streak < READAHEAD_TRIGGER)
+  {
+    return;
+  }
+  if (ra->random)
+  {
+    readahead_advise(node, 0, nblocks, BLOCKS_ADVISE_NORMAL);
+    ra->random = 0;
+  }
+
+  // ask for the next window once the reader is into the second half of the
+  // last one, so it arrives before it is needed
+  if (ra->ahead - last > ra->window / 2)
+  {
+    return;
+  }
+  int from = ra->ahead > last + 1 ? ra->ahead : last + 1;
+  ra->window = ra->window == 0 ? READAHEAD_MIN : ra->window * 2;
+  ra->window = ra->window < READAHEAD_MAX ? ra->window : READAHEAD_MAX;
+  int to = from + ra->window < nblocks ? from + ra->window : nblocks;
+  if (from < to)
+  {
+    readahead_advise(node, from, to, BLOCKS_ADVISE_WILLNEED);
+  }
+  ra->ahead = to > from ? to : from;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file readahead.h
+ *
+ * Readahead that knows where files are.
+ *
+ * Reads fault blocks in from the mapped image, and the kernel reads ahead
+ * around each fault in image order, which past the end of a file's extent is
+ * someone else's data. Instead we watch each file's reads: once they follow
+ * on from each other we ask for the file's next blocks ahead of time, in a
+ * window that doubles up to READAHEAD_MAX, and once they jump around we ask
+ * the kernel not to read around faults in the file at all.
+ */
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <sys/types.h>
+
+#define READAHEAD_MIN 4      // blocks read ahead when a file turns sequential
+#define READAHEAD_MAX 64     // most blocks read ahead at a time
+#define READAHEAD_TRIGGER 2  // reads in a row that decide how a file is read
+
+/**
+ * Start watching a file afresh. Call when it is opened.
+ *
+ * @param inum The inode number.
+ */
+void readahead_open(int inum);
+
+/**
+ * Note a read of a file and read ahead or advise as its pattern calls for.
+ * Call before copying the data out.
+ *
+ * @param inum The inode number.
+ * @param offset Offset of the read, inside the file.
+ * @param size Size of the read, not past the end of the file.
+ */
+void readahead_read(int inum, off_t offset, size_t size);
+
+#endif
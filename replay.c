@@ -0,0 +1,408 @@
+/**
+ * @file replay.c
+ *
+ * replay.nufs: play back a trace recorded with the trace mount option, to
+ * measure a change against real traffic.
+ *
+ * Usage: replay.nufs [-f] trace image
+ *        replay.nufs [-f] -m mountpoint trace
+ *
+ * The first form calls the storage layer on the image directly, the way the
+ * mount does, without FUSE or the kernel in the way. The second issues the
+ * system calls under a mounted nufs (or any other filesystem). Operations are
+ * issued at the times they were captured, or back to back with -f. Data is not
+ * in the trace, so writes store a fixed pattern.
+ *
+ * Prints the count and mean latency of each kind of operation, as captured
+ * and as replayed, and how many of them succeeded in one and failed in the
+ * other.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "defrag.h"
+#include "directory.h"
+#include "inode.h"
+#include "orphan.h"
+#include "storage.h"
+#include "trace.h"
+
+#define REPLAY_PATH_MAX 65536
+#define REPLAY_FDS 16 // descriptors kept per file handle when mounted
+
+typedef struct replay_stat {
+  u_int64_t count;
+  u_int64_t captured; // ns
+  u_int64_t replayed; // ns
+  u_int64_t mismatched;
+} replay_stat_t;
+
+static replay_stat_t stats[TRACE_OP_COUNT];
+
+static const char *mountpoint = NULL;
+static char *data = NULL;
+static size_t data_size = 0;
+
+// direct: the captured file handle is the inum in the captured image, which
+// need not be the one the replay gets, so opens are mapped
+static int fh_inum[INODE_COUNT];
+
+// mounted: descriptors of the files open under each captured handle, the
+// most recently opened last
+static int fh_fds[INODE_COUNT][REPLAY_FDS];
+static int fh_nfds[INODE_COUNT];
+
+static void usage()
+{
+  fprintf(stderr, "usage: replay.nufs [-f] trace image\n"
+                  "       replay.nufs [-f] -m mountpoint trace\n");
+  exit(1);
+}
+
+// Make the write buffer at least size bytes.
+static void data_reserve(size_t size)
+{
+  if (size > data_size)
+  {
+    data = realloc(data, size);
+    memset(data, 0xa5, size);
+    data_size = size;
+  }
+}
+
+// Replay one operation into the storage layer, as nufs.c would serve it.
+static int replay_direct(const trace_record_t *rec, const char *path,
+                         const char *path2)
+{
+  struct stat st;
+  struct statvfs stvfs;
+  int fh = rec->fh < INODE_COUNT ? (int)rec->fh : -1;
+  int inum = fh != -1 ? fh_inum[fh] : -1;
+  int rv = 0;
+
+  storage_lock();
+  switch (rec->op)
+  {
+  case TRACE_ACCESS:
+    rv = tree_lookup(path) != -1 ? 0 : -1;
+    break;
+  case TRACE_GETATTR:
+    rv = storage_stat(path, &st);
+    break;
+  case TRACE_READDIR:
+  {
+    slist_t *names = directory_list_path(path);
+    char entry[REPLAY_PATH_MAX];
+    for (slist_t *cur = names; cur != NULL && rv == 0; cur = cur->next)
+    {
+      snprintf(entry, sizeof(entry), "%s/%s", strcmp(path, "/") ? path : "",
+               cur->data);
+      rv = storage_stat(entry, &st);
+    }
+    s_free(names);
+    break;
+  }
+  case TRACE_MKNOD:
+    rv = find_or_create(path, rec->mode) != -1 ? 0 : -1;
+    break;
+  case TRACE_MKDIR:
+    rv = storage_mkdir(path);
+    break;
+  case TRACE_LINK:
+    rv = storage_link(path, path2);
+    break;
+  case TRACE_UNLINK:
+  case TRACE_RMDIR:
+    rv = storage_unlink(path);
+    break;
+  case TRACE_RENAME:
+    rv = storage_rename(path, path2);
+    break;
+  case TRACE_TRUNCATE:
+    rv = storage_truncate(path, rec->size);
+    break;
+  case TRACE_FALLOCATE:
+    inum = inum != -1 ? inum : tree_lookup(path);
+    rv = inum != -1
+             ? storage_fallocate(inum, rec->mode, rec->offset, rec->size)
+             : -ENOENT;
+    break;
+  case TRACE_OPEN:
+    inum = storage_open(path);
+    if (inum != -1)
+    {
+      storage_keep_cache(inum);
+    }
+    if (fh != -1)
+    {
+      fh_inum[fh] = inum;
+    }
+    rv = inum != -1 ? 0 : -ENOENT;
+    break;
+  case TRACE_RELEASE:
+    if (inum != -1)
+    {
+      storage_release(inum);
+    }
+    break;
+  case TRACE_READ:
+    data_reserve(rec->size);
+    rv = inum != -1 ? storage_read_inum(inum, data, rec->size, rec->offset)
+                    : storage_read(path, data, rec->size, rec->offset);
+    break;
+  case TRACE_WRITE:
+    data_reserve(rec->size);
+    rv = inum != -1 ? storage_write_inum(inum, data, rec->size, rec->offset)
+                    : storage_write(path, data, rec->size, rec->offset);
+    break;
+  case TRACE_STATFS:
+    rv = storage_statfs(&stvfs);
+    break;
+  case TRACE_FSYNC:
+    rv = storage_sync();
+    break;
+  case TRACE_UTIMENS:
+  {
+    struct timespec ts[2];
+    clock_gettime(CLOCK_REALTIME, &ts[0]);
+    ts[1] = ts[0];
+    rv = storage_set_time(path, ts) == 0 ? 0 : -ENOENT;
+    break;
+  }
+  }
+  storage_unlock();
+  return rv;
+}
+
+// Descriptor for the file a mounted operation is on: the one opened under
+// its handle, or else *tmp, freshly opened by path.
+static int replay_fd(const trace_record_t *rec, const char *full, int *tmp)
+{
+  if (rec->fh < INODE_COUNT && fh_nfds[rec->fh] > 0)
+  {
+    return fh_fds[rec->fh][fh_nfds[rec->fh] - 1];
+  }
+  *tmp = open(full, O_RDWR);
+  return *tmp;
+}
+
+// Replay one operation as a system call under the mount point.
+static int replay_mounted(const trace_record_t *rec, const char *path,
+                          const char *path2)
+{
+  char full[REPLAY_PATH_MAX];
+  char full2[REPLAY_PATH_MAX];
+  struct stat st;
+  struct statvfs stvfs;
+  int tmp = -1;
+  int fd;
+  int rv = 0;
+
+  snprintf(full, sizeof(full), "%s%s", mountpoint, path);
+  snprintf(full2, sizeof(full2), "%s%s", mountpoint, path2);
+  switch (rec->op)
+  {
+  case TRACE_ACCESS:
+    rv = access(full, rec->mode);
+    break;
+  case TRACE_GETATTR:
+    rv = lstat(full, &st);
+    break;
+  case TRACE_READDIR:
+  {
+    DIR *dir = opendir(full);
+    if (dir == NULL)
+    {
+      rv = -1;
+      break;
+    }
+    while (readdir(dir) != NULL)
+    {
+    }
+    closedir(dir);
+    break;
+  }
+  case TRACE_MKNOD:
+    rv = mknod(full, rec->mode, 0);
+    break;
+  case TRACE_MKDIR:
+    rv = mkdir(full, rec->mode);
+    break;
+  case TRACE_LINK:
+    rv = link(full, full2);
+    break;
+  case TRACE_UNLINK:
+    rv = unlink(full);
+    break;
+  case TRACE_RMDIR:
+    rv = rmdir(full);
+    break;
+  case TRACE_RENAME:
+    rv = rename(full, full2);
+    break;
+  case TRACE_TRUNCATE:
+    rv = truncate(full, rec->size);
+    break;
+  case TRACE_FALLOCATE:
+    fd = replay_fd(rec, full, &tmp);
+    rv = fallocate(fd, rec->mode, rec->offset, rec->size);
+    break;
+  case TRACE_OPEN:
+    // creating and truncating were captured as mknod and truncate
+    fd = open(full, rec->mode & ~(O_CREAT | O_EXCL | O_TRUNC));
+    if (fd != -1 && rec->fh < INODE_COUNT && fh_nfds[rec->fh] < REPLAY_FDS)
+    {
+      fh_fds[rec->fh][fh_nfds[rec->fh]++] = fd;
+    }
+    else if (fd != -1)
+    {
+      close(fd);
+    }
+    rv = fd != -1 ? 0 : -1;
+    break;
+  case TRACE_RELEASE:
+    if (rec->fh < INODE_COUNT && fh_nfds[rec->fh] > 0)
+    {
+      close(fh_fds[rec->fh][--fh_nfds[rec->fh]]);
+    }
+    break;
+  case TRACE_READ:
+    data_reserve(rec->size);
+    fd = replay_fd(rec, full, &tmp);
+    rv = pread(fd, data, rec->size, rec->offset);
+    break;
+  case TRACE_WRITE:
+    data_reserve(rec->size);
+    fd = replay_fd(rec, full, &tmp);
+    rv = pwrite(fd, data, rec->size, rec->offset);
+    break;
+  case TRACE_STATFS:
+    rv = statvfs(full, &stvfs);
+    break;
+  case TRACE_FSYNC:
+    fd = replay_fd(rec, full, &tmp);
+    rv = fsync(fd);
+    break;
+  case TRACE_UTIMENS:
+    rv = utimensat(AT_FDCWD, full, NULL, 0);
+    break;
+  }
+  if (tmp != -1)
+  {
+    close(tmp);
+  }
+  return rv;
+}
+
+// Wait until the given ns after the replay started.
+static void replay_wait(u_int64_t epoch, u_int64_t at)
+{
+  u_int64_t when = epoch + at;
+  struct timespec ts = {.tv_sec = when / 1000000000,
+                        .tv_nsec = when % 1000000000};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+  {
+  }
+}
+
+static void print_stats(u_int64_t elapsed)
+{
+  printf("%-10s %10s %14s %14s %10s\n", "op", "count", "captured us",
+         "replayed us", "mismatched");
+  for (int op = 0; op < TRACE_OP_COUNT; op++)
+  {
+    replay_stat_t *s = &stats[op];
+    if (s->count == 0)
+    {
+      continue;
+    }
+    printf("%-10s %10llu %14.1f %14.1f %10llu\n", trace_op_name(op),
+           (unsigned long long)s->count, s->captured / 1000.0 / s->count,
+           s->replayed / 1000.0 / s->count, (unsigned long long)s->mismatched);
+  }
+  printf("replayed in %.3f s\n", elapsed / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+  int fast = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "fm:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'f':
+      fast = 1;
+      break;
+    case 'm':
+      mountpoint = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - (mountpoint != NULL ? 1 : 2))
+  {
+    usage();
+  }
+  const char *trace_path = argv[optind];
+
+  FILE *f = trace_read_open(trace_path);
+  if (f == NULL)
+  {
+    fprintf(stderr, "replay.nufs: %s: %s\n", trace_path,
+            errno == EINVAL ? "not a trace" : strerror(errno));
+    return 1;
+  }
+  if (mountpoint == NULL)
+  {
+    storage_init(argv[optind + 1], BLOCKS_STRIPE_UNIT, 0);
+    // as nufs_init, so the background work competes the same way
+    reclaim_start();
+    defrag_start();
+  }
+  memset(fh_inum, -1, sizeof(fh_inum));
+
+  static char path[REPLAY_PATH_MAX];
+  static char path2[REPLAY_PATH_MAX];
+  trace_record_t rec;
+  int rv;
+  u_int64_t epoch = trace_now();
+  while ((rv = trace_read(f, &rec, path, path2)) == 1)
+  {
+    if (!fast)
+    {
+      replay_wait(epoch, rec.start);
+    }
+    u_int64_t start = trace_now();
+    int result = mountpoint != NULL ? replay_mounted(&rec, path, path2)
+                                    : replay_direct(&rec, path, path2);
+    replay_stat_t *s = &stats[rec.op];
+    s->count++;
+    s->captured += rec.duration;
+    s->replayed += trace_now() - start;
+    s->mismatched += (result < 0) != (rec.result < 0);
+  }
+  u_int64_t elapsed = trace_now() - epoch;
+  fclose(f);
+  if (mountpoint == NULL)
+  {
+    storage_free();
+  }
+  if (rv == -1)
+  {
+    fprintf(stderr, "replay.nufs: %s: trace is corrupt\n", trace_path);
+  }
+  print_stats(elapsed);
+  return rv == -1 ? 1 : 0;
+}
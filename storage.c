@@ -1,26 +1,163 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include "append.h"
 #include "bitmap.h"
 #include "inode.h"
 #include "storage.h"
+#include "csum.h"
+#include "dedup.h"
+#include "defrag.h"
 #include "directory.h"
+#include "discard.h"
+#include "frag.h"
+#include "orphan.h"
+#include "readahead.h"
+#include "super.h"
+#include "usage.h"
 
-void storage_init(const char *image_path)
+// serializes the FUSE operations and the background reclaimer; recursive
+// because operations are built out of other operations
+static pthread_mutex_t storage_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+void storage_lock()
+{
+  pthread_mutex_lock(&storage_mutex);
+}
+
+void storage_unlock()
+{
+  pthread_mutex_unlock(&storage_mutex);
+}
+
+// waits on the given condition, releasing the storage lock meanwhile; the
+// lock must be held exactly once
+void storage_wait(pthread_cond_t *cond)
+{
+  pthread_cond_wait(cond, &storage_mutex);
+}
+
+// like storage_wait, giving up at the given (CLOCK_REALTIME) time
+void storage_timedwait(pthread_cond_t *cond, const struct timespec *until)
+{
+  pthread_cond_timedwait(cond, &storage_mutex, until);
+}
+
+// per inode, bumped whenever its data changes other than by a write (the
+// kernel updates its page cache as writes go through it), and its value at
+// the last open; kept in memory only, like the kernel's cache
+static u_int32_t data_gen[INODE_COUNT];
+static u_int32_t open_gen[INODE_COUNT];
+
+static int storage_flags = 0; // BLOCKS_* flags the image was opened with
+
+// BLOCKS_HOT_META: fault in the bitmaps, the inode table and the directories
+// up front, so lookups do not wait for the disk
+static void storage_hot_meta()
+{
+  void *ibm = get_inode_bitmap();
+  int bnums[2 + INODE_COUNT] = {0, INODE_BLOCK};
+  int count = 2;
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    if (bitmap_get(ibm, inum) && get_inode(inum)->mode == DIRECTORY_MODE)
+    {
+      bnums[count++] = get_inode(inum)->block;
+    }
+  }
+  blocks_advise(bnums, count, BLOCKS_ADVISE_HOT);
+  fprintf(stderr, "+ storage_hot_meta() -> %d blocks\n", count);
+}
+
+// opens the disk image(s), formatting them if they are new; read-only ones
+// are left exactly as they are
+void storage_init(const char *image_path, int stripe_unit, int flags)
 {
-  blocks_init(image_path);
-  void *bbm = get_blocks_bitmap();
-  if (bitmap_get(bbm, 1) == 0)
+  storage_flags = flags;
+  int loaded = super_load(image_path, stripe_unit, flags);
+  int clean = loaded && get_superblock()->state == SUPER_CLEAN;
+  if (flags & BLOCKS_RDONLY)
+  {
+    // nothing is written, not even the mount count
+    if (!loaded)
+    {
+      fprintf(stderr, "+ storage_init: %s is not a nufs image\n", image_path);
+      exit(1);
+    }
+    csum_init(clean, flags);
+    if (flags & BLOCKS_HOT_META)
+    {
+      storage_hot_meta();
+    }
+    return;
+  }
+  if (!loaded)
+  {
+    // new image, or one made before there was a superblock; format first so
+    // the allocators below start from correct free counts
+    super_format();
+    void *bbm = get_blocks_bitmap();
+    if (bitmap_get(bbm, 1) == 0)
+    {
+      int inode_block = alloc_block();
+      assert(inode_block == INODE_BLOCK);
+    }
+    if (bitmap_get(bbm, 2) == 0)
+    {
+      root_init();
+    }
+  }
+  else if (get_superblock()->state != SUPER_CLEAN)
   {
-    int inode_block = alloc_block();
-    assert(inode_block == INODE_BLOCK);
+    fprintf(stderr, "+ storage_init: %s was not unmounted cleanly, "
+                    "run fsck.nufs on it\n",
+            image_path);
+    // the free counters may be stale, but they are cheap to rebuild
+    super_recount();
   }
-  if (bitmap_get(bbm, 2) == 0)
+  // before the passes below, which may rewrite blocks: their groups must be
+  // stamped for an incremental export to pick them up
+  super_mount();
+  usage_init(clean);
+  frag_init();
+  csum_init(clean, flags);
+  dedup_init(flags & BLOCKS_DEDUP);
+  if (flags & BLOCKS_HOT_META)
   {
-    root_init();
+    storage_hot_meta();
   }
 }
 
+// writes all modified blocks back to the disk image
+int storage_sync()
+{
+  usage_flush();
+  inode_flush_times();
+  return blocks_sync();
+}
+
+// flushes and closes the disk image
+void storage_free()
+{
+  // before taking the lock, which the threads need in order to exit
+  reclaim_stop();
+  discard_stop();
+  defrag_stop();
+  storage_lock();
+  if (!(storage_flags & BLOCKS_RDONLY))
+  {
+    usage_flush();
+    inode_flush_times();
+    super_unmount();
+  }
+  blocks_free();
+  storage_unlock();
+}
+
 // split the given path into a directory path and a filenmae
 char **split_path(const char *path)
 {
@@ -57,6 +194,40 @@ char **split_path(const char *path)
   return result;
 }
 
+// creates a new inode named name in the directory inum_dir and returns its
+// inum, or -1 if out of inodes or the directory is full
+static int create_in(int inum_dir, const char *name, mode_t mode)
+{
+  int inum = alloc_inode(mode);
+  if (inum == -1)
+  { // out of inodes
+    return -1;
+  }
+  if (directory_put(get_inode(inum_dir), name, inum) == -1)
+  { // directory is full
+    free_inode(inum);
+    return -1;
+  }
+  inode_touch(inum_dir, INODE_MTIME | INODE_CTIME);
+  return inum;
+}
+
+// makes a directory named name in the directory inum_dir, holding its "."
+// and ".." entries; returns its inum or -1
+static int mkdir_in(int inum_dir, const char *name)
+{
+  int inum = create_in(inum_dir, name, DIRECTORY_MODE);
+  if (inum == -1)
+  {
+    return -1;
+  }
+  inode_t *dir = get_inode(inum);
+  directory_init(dir);
+  directory_put(dir, ".", inum);
+  directory_put(dir, "..", inum_dir);
+  return inum;
+}
+
 //Find the inum for a path, or create the item if it doesn't exist
 int find_or_create(const char *path, mode_t mode)
 {
@@ -65,20 +236,34 @@ int find_or_create(const char *path, mode_t mode)
   {
     return inum;
   }
-  inum = alloc_inode(mode);
   char **sp = split_path(path);
   int inum_dir = tree_lookup(sp[0]);
-  if (inum_dir == -1)
+  if (inum_dir != -1)
   {
-    return -1;
+    inum = create_in(inum_dir, sp[1], mode);
   }
-  directory_put(get_inode(inum_dir), sp[1], inum);
   free(sp[0]);
   free(sp[1]);
   free(sp);
   return inum;
 }
 
+// makes a directory at path holding its "." and ".." entries
+int storage_mkdir(const char *path)
+{
+  if (tree_lookup(path) != -1)
+  { // already exists; the kernel checks, but replay.nufs does not
+    return -1;
+  }
+  char **sp = split_path(path);
+  int inum_dir = tree_lookup(sp[0]);
+  int inum = inum_dir != -1 ? mkdir_in(inum_dir, sp[1]) : -1;
+  free(sp[0]);
+  free(sp[1]);
+  free(sp);
+  return inum != -1 ? 0 : -1;
+}
+
 // gets the details on the file at path and sets them in the stat struct
 int storage_stat(const char *path, struct stat *st)
 {
@@ -92,6 +277,7 @@ int storage_stat(const char *path, struct stat *st)
   st->st_size = inode->size;
   st->st_nlink = inode->ref_count;
   st->st_uid = getuid(); // From demo code
+  inode_get_times(inum, &st->st_atime, &st->st_mtime, &st->st_ctime);
   return 0;
 }
 
@@ -103,16 +289,77 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset)
   {
     return -1;
   }
+  return storage_read_inum(inum, buf, size, offset);
+}
+
+// reads size bytes from the file with the given inum, offset from the beginning of the file, into the buffer buf;
+// -EIO if a block read fails its checksum
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset)
+{
   inode_t *inode = get_inode(inum);
-  if (offset > inode->size)
+  if (offset >= inode->size)
   {
     return 0;
   }
-  char *start = ((char *)blocks_get_block(inode->block)) + offset;
-  size_t size_to_read = size + offset < 4096 ? size : 4096 - offset;
-  fprintf(stderr, "+ read %d bytes from %p\n", (int) size_to_read, start);
-  memcpy(buf, start, size_to_read);
-  return size_to_read;
+  if (offset + size > inode->size)
+  {
+    size = inode->size - offset;
+  }
+
+  readahead_read(inum, offset, size);
+
+  // bring in every block of the range in one batch before copying
+  int first = offset / BLOCK_SIZE;
+  int last = (offset + size - 1) / BLOCK_SIZE;
+  int bnums[INODE_MAX_BLOCKS];
+  int count = 0;
+  for (int fbnum = first; fbnum <= last; fbnum++)
+  {
+    int bnum = inode_get_bnum(inode, fbnum);
+    if (bnum != 0 && !inode_unwritten(inode, fbnum))
+    {
+      bnums[count++] = bnum;
+    }
+  }
+  blocks_prefetch(bnums, count);
+
+  size_t done = 0;
+  while (done < size)
+  {
+    off_t pos = offset + done;
+    int fbnum = pos / BLOCK_SIZE;
+    int bnum = inode_get_bnum(inode, fbnum);
+    size_t chunk = BLOCK_SIZE - pos % BLOCK_SIZE;
+    chunk = chunk < size - done ? chunk : size - done;
+    const char *tail = frag_tail(inode, fbnum);
+    if (tail != NULL)
+    {
+      if (csum_verify(FRAG_BNUM(inode->tail)) == -1)
+      {
+        return -EIO;
+      }
+      memcpy(buf + done, tail + pos % BLOCK_SIZE, chunk);
+    }
+    else if (bnum == 0 || inode_unwritten(inode, fbnum))
+    { // hole, or preallocated and never written
+      memset(buf + done, 0, chunk);
+    }
+    else
+    {
+      if (csum_verify(bnum) == -1)
+      {
+        return -EIO;
+      }
+      memcpy(buf + done, (char *)blocks_get_block(bnum) + pos % BLOCK_SIZE, chunk);
+    }
+    done += chunk;
+  }
+  fprintf(stderr, "+ read %d bytes from inode %d\n", (int) size, inum);
+  if (!(storage_flags & BLOCKS_RDONLY))
+  {
+    inode_touch(inum, INODE_ATIME);
+  }
+  return size;
 }
 
 // writes size bytes to the file at path, offset from the beginning of the file, from the buffer buf
@@ -126,23 +373,80 @@ int storage_write(const char *path, const char *buf, size_t size, off_t offset)
     { // containing directory does not exist
       return -1;
     }
-    // tries to set the new file size to be large enough for the size after offsetting, at most one block
-    get_inode(inum)->size = offset + size < 4096 ? offset + size : 4096;
   }
-  inode_t *inode = get_inode(inum);
-  if (offset > inode->size)
+  // not a write the kernel made, so its cache may not have it
+  data_gen[inum]++;
+  return storage_write_inum(inum, buf, size, offset);
+}
+
+// writes into the file's blocks wherever they are, allocating the missing ones
+// and zeroing the preallocated ones
+static int write_blocks(inode_t *inode, const char *buf, size_t size, off_t offset)
+{
+  if (offset > inode->size && grow_inode(inode, offset - inode->size) == -1)
+  { // too large
+    return -1;
+  }
+  size_t done = 0;
+  while (done < size)
+  {
+    off_t pos = offset + done;
+    int fbnum = pos / BLOCK_SIZE;
+    size_t chunk = BLOCK_SIZE - pos % BLOCK_SIZE;
+    chunk = chunk < size - done ? chunk : size - done;
+    if (chunk == BLOCK_SIZE && dedup_write(inode, fbnum, buf + done))
+    { // the same bytes are already stored
+      done += chunk;
+      continue;
+    }
+    int bnum = inode_write_bnum(inode, fbnum);
+    if (bnum == -1)
+    { // disk full or file too large
+      break;
+    }
+    memcpy((char *)blocks_get_block(bnum) + pos % BLOCK_SIZE, buf + done, chunk);
+    blocks_mark_dirty(bnum);
+    done += chunk;
+    if ((pos + chunk) % BLOCK_SIZE == 0)
+    {
+      dedup_block(inode, fbnum);
+    }
+  }
+  if (offset + done > inode->size)
   {
+    inode->size = offset + done;
+    blocks_mark_dirty(INODE_BLOCK);
+  }
+  return done == 0 && size > 0 ? -1 : (int)done;
+}
+
+// writes size bytes to the file with the given inum, offset from the beginning of the file, from the buffer buf
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset)
+{
+  inode_t *inode = get_inode(inum);
+  int rv;
+  if (frag_unpack(inum) == -1)
+  { // no room for the tail's block
     return -1;
   }
-  char *start = ((char *)blocks_get_block(inode->block)) + offset;
-  size_t size_to_write = size + offset < 4096 ? size : 4096 - offset; // clamp SIZE_TO_WRITE in legal values
-  inode->size = size_to_write + offset;
-  fprintf(stderr, "+ write %d bytes to %p\n", (int) size_to_write, start);
-  memcpy(start, buf, size_to_write);
-  return size_to_write;
+  if (offset == inode->size)
+  {
+    rv = append_write(inum, buf, size);
+  }
+  else
+  {
+    rv = write_blocks(inode, buf, size, offset);
+  }
+  fprintf(stderr, "+ write %d bytes to inode %d\n", rv, inum);
+  if (rv > 0)
+  {
+    inode_touch(inum, INODE_MTIME | INODE_CTIME);
+    usage_dirty(inum);
+  }
+  return rv;
 }
 
-// changes the file at path's size to the given size, at most one block
+// changes the file at path's size to the given size
 int storage_truncate(const char *path, off_t size)
 {
   int inum = tree_lookup(path);
@@ -151,14 +455,127 @@ int storage_truncate(const char *path, off_t size)
     return -1;
   }
   inode_t *inode = get_inode(inum);
-  if (size > 4096)
+  if (frag_unpack(inum) == -1)
   {
     return -1;
   }
-  inode->size = size;
+  append_forget(inum);
+  data_gen[inum]++;
+  usage_dirty(inum);
+  if (size > inode->size)
+  {
+    if (grow_inode(inode, size - inode->size) == -1)
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    shrink_inode(inode, inode->size - size);
+  }
+  inode_touch(inum, INODE_MTIME | INODE_CTIME);
   return 0;
 }
 
+// preallocates, punches a hole in or zeroes the given range of the file
+// with the given inum, as fallocate(2) does for the modes in mode; returns 0
+// or -errno
+int storage_fallocate(int inum, int mode, off_t offset, off_t length)
+{
+  int supported = FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE;
+  int punch = mode & FALLOC_FL_PUNCH_HOLE;
+  int zero = mode & FALLOC_FL_ZERO_RANGE;
+  if ((mode & ~supported) || (punch && zero) ||
+      (punch && !(mode & FALLOC_FL_KEEP_SIZE)))
+  {
+    return -EOPNOTSUPP;
+  }
+  if (offset < 0 || length <= 0)
+  {
+    return -EINVAL;
+  }
+  off_t end = offset + length;
+  if (end > INODE_MAX_SIZE)
+  {
+    return -EFBIG;
+  }
+
+  inode_t *inode = get_inode(inum);
+  int old_size = inode->size;
+  if (frag_unpack(inum) == -1)
+  {
+    return -ENOSPC;
+  }
+  append_forget(inum);
+  data_gen[inum]++;
+  usage_dirty(inum);
+  int rv = 0;
+  for (int fbnum = offset / BLOCK_SIZE; fbnum <= (end - 1) / BLOCK_SIZE; fbnum++)
+  {
+    // the part of the range falling in this block
+    off_t from = fbnum * (off_t)BLOCK_SIZE > offset ? fbnum * (off_t)BLOCK_SIZE : offset;
+    off_t to = (fbnum + 1) * (off_t)BLOCK_SIZE < end ? (fbnum + 1) * (off_t)BLOCK_SIZE : end;
+    int whole = to - from == BLOCK_SIZE;
+    int bnum = inode_get_bnum(inode, fbnum);
+
+    if (bnum == 0)
+    {
+      // holes already read as zeros, but preallocating and zeroing both
+      // leave the range allocated
+      if (!punch && inode_alloc_bnum(inode, fbnum, 1) == -1)
+      {
+        rv = -ENOSPC;
+        break;
+      }
+    }
+    else if (whole && punch)
+    {
+      inode_set_bnum(inode, fbnum, 0);
+      free_block(bnum);
+    }
+    else if ((punch || zero) && !inode_unwritten(inode, fbnum))
+    {
+      if (whole)
+      {
+        inode_set_bnum(inode, fbnum, bnum | INODE_UNWRITTEN);
+      }
+      else
+      {
+        // in place, unless other files share the block
+        bnum = inode_write_bnum(inode, fbnum);
+        if (bnum == -1)
+        {
+          rv = -ENOSPC;
+          break;
+        }
+        memset((char *)blocks_get_block(bnum) + from % BLOCK_SIZE, 0, to - from);
+        blocks_mark_dirty(bnum);
+      }
+    }
+  }
+
+  if (punch)
+  {
+    // punching every block it names leaves the indirect block empty
+    inode_drop_iblock(inode);
+  }
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->size)
+  {
+    // only up to where the allocation got to
+    off_t size = rv == 0 ? end : (off_t)inode->size;
+    grow_inode(inode, size - inode->size);
+  }
+  if (punch || zero || inode->size != old_size)
+  {
+    inode_touch(inum, INODE_MTIME | INODE_CTIME);
+  }
+  else
+  {
+    inode_touch(inum, INODE_CTIME);
+  }
+  return rv;
+}
+
 // removes a link to a file from a directory
 int storage_unlink(const char *path)
 {
@@ -176,6 +593,11 @@ int storage_unlink(const char *path)
     return -1;
   }
   directory_delete(get_inode(inum_dir), sp[1]);
+  inode_touch(inum_dir, INODE_MTIME | INODE_CTIME);
+  if (get_inode(inum)->ref_count > 0)
+  {
+    inode_touch(inum, INODE_CTIME);
+  }
   free(sp[0]);
   free(sp[1]);
   free(sp);
@@ -197,27 +619,287 @@ int storage_link(const char *from, const char *to)
   }
   char **sp = split_path(to);
   int inumto_dir = tree_lookup(sp[0]);
+  int rv = 0;
   if (inumto_dir == -1)
   {
-    return -1;
+    rv = -1;
+  }
+  else if (directory_put(get_inode(inumto_dir), sp[1], inumfrom) == -1)
+  { // directory is full
+    rv = -ENOSPC;
+  }
+  else
+  {
+    inode_touch(inumto_dir, INODE_MTIME | INODE_CTIME);
+    inode_touch(inumfrom, INODE_CTIME);
   }
-  directory_put(get_inode(inumto_dir), sp[1], inumfrom);
   free(sp[0]);
   free(sp[1]);
   free(sp);
-  return 0;
+  return rv;
 }
 
 // renames the given file
 int storage_rename(const char *from, const char *to)
 {
-  if (storage_link(from, to) == -1)
+  int rv = storage_link(from, to);
+  if (rv < 0)
   {
-    return -1;
+    return rv;
   }
   if (storage_unlink(from) == -1)
   {
     return -1;
   }
   return 0;
-}
\ No newline at end of file
+}
+
+// sets the access and modification times of the file at path
+int storage_set_time(const char *path, const struct timespec ts[2])
+{
+  int inum = tree_lookup(path);
+  if (inum == -1)
+  {
+    return -1;
+  }
+  time_t atime;
+  time_t mtime;
+  time_t ctime;
+  inode_get_times(inum, &atime, &mtime, &ctime);
+  time_t now = time(NULL);
+  if (ts[0].tv_nsec != UTIME_OMIT)
+  {
+    atime = ts[0].tv_nsec == UTIME_NOW ? now : ts[0].tv_sec;
+  }
+  if (ts[1].tv_nsec != UTIME_OMIT)
+  {
+    mtime = ts[1].tv_nsec == UTIME_NOW ? now : ts[1].tv_sec;
+  }
+  inode_set_times(inum, atime, mtime);
+  return 0;
+}
+
+// fills in the filesystem statistics from the superblock's free counters
+int storage_statfs(struct statvfs *st)
+{
+  superblock_t *sb = get_superblock();
+  memset(st, 0, sizeof(struct statvfs));
+  st->f_bsize = BLOCK_SIZE;
+  st->f_frsize = BLOCK_SIZE;
+  st->f_blocks = blocks_count();
+  st->f_bfree = sb->free_blocks;
+  st->f_bavail = sb->free_blocks;
+  st->f_files = INODE_COUNT;
+  st->f_ffree = sb->free_inodes;
+  st->f_favail = sb->free_inodes;
+  st->f_namemax = DIR_NAME_LENGTH - 1;
+  return 0;
+}
+
+// grows the volume to the given number of blocks while mounted; returns 0
+// or -errno
+int storage_grow(int count)
+{
+  if (storage_flags & BLOCKS_RDONLY)
+  {
+    return -EROFS;
+  }
+  if (count > BLOCKS_MAX_COUNT)
+  {
+    return -EFBIG;
+  }
+  return super_grow(count);
+}
+
+// gets the space used beneath the directory at path, or by the file at
+// path; returns 0 or -errno
+int storage_usage(const char *path, struct nufs_usage *usage)
+{
+  int inum = tree_lookup(path);
+  if (inum == -1)
+  {
+    return -ENOENT;
+  }
+  return usage_get(inum, usage);
+}
+
+// gets every entry of the directory at path, but "." and "..", with its
+// stat data; returns 0 or -errno
+int storage_bulkstat(const char *path, struct nufs_bulkstat *bulk)
+{
+  int inum_dir = tree_lookup(path);
+  if (inum_dir == -1)
+  {
+    return -ENOENT;
+  }
+  inode_t *dd = get_inode(inum_dir);
+  if (dd->mode != DIRECTORY_MODE)
+  {
+    return -ENOTDIR;
+  }
+  memset(bulk, 0, sizeof(*bulk));
+  dirhead_t *dir = directory_head(blocks_get_block(dd->block));
+  direntry_t *entries_start = (direntry_t *)(dir + 1);
+  for (int i = 0; i < dir->num_slots && bulk->count < NUFS_BULK_MAX; i++)
+  {
+    direntry_t *entry = entries_start + i;
+    if (entry->present != 1 || strcmp(entry->name, ".") == 0 ||
+        strcmp(entry->name, "..") == 0)
+    {
+      continue;
+    }
+    struct nufs_stat *ns = &bulk->entries[bulk->count++];
+    inode_t *node = get_inode(entry->inum);
+    strncpy(ns->name, entry->name, NUFS_NAME_MAX - 1);
+    ns->ino = entry->inum;
+    ns->mode = node->mode;
+    ns->nlink = node->ref_count;
+    ns->size = node->size;
+    time_t atime, mtime, ctime;
+    inode_get_times(entry->inum, &atime, &mtime, &ctime);
+    ns->atime = atime;
+    ns->mtime = mtime;
+    ns->ctime = ctime;
+  }
+  return 0;
+}
+
+// removes the entry name for inum from the directory inum_dir; a directory
+// must be empty, and drops its "." and ".." entries first so it is freed
+static int unlink_in(int inum_dir, const char *name, int inum)
+{
+  inode_t *node = get_inode(inum);
+  if (node->mode == DIRECTORY_MODE)
+  {
+    dirhead_t *dir = directory_head(blocks_get_block(node->block));
+    if (dir->num_entries > 2)
+    {
+      return -ENOTEMPTY;
+    }
+    directory_delete(node, "..");
+    directory_delete(node, ".");
+  }
+  directory_delete(get_inode(inum_dir), name);
+  inode_touch(inum_dir, INODE_MTIME | INODE_CTIME);
+  if (node->ref_count > 0)
+  {
+    inode_touch(inum, INODE_CTIME);
+  }
+  return 0;
+}
+
+// applies one operation of a batch to the directory inum_dir; returns 0 or
+// -errno
+static int batch_op(int inum_dir, struct nufs_batch_op *op)
+{
+  if (strnlen(op->name, NUFS_NAME_MAX) >= DIR_NAME_LENGTH)
+  {
+    return -ENAMETOOLONG;
+  }
+  if (op->name[0] == '\0' || strchr(op->name, '/') != NULL ||
+      strcmp(op->name, ".") == 0 || strcmp(op->name, "..") == 0)
+  {
+    return -EINVAL;
+  }
+  int inum = directory_lookup(get_inode(inum_dir), op->name);
+  switch (op->op)
+  {
+  case NUFS_BATCH_CREATE:
+  case NUFS_BATCH_MKDIR:
+    if (inum != -1)
+    {
+      return -EEXIST;
+    }
+    if (op->op == NUFS_BATCH_MKDIR)
+    {
+      inum = mkdir_in(inum_dir, op->name);
+    }
+    else if (S_ISDIR(op->mode))
+    {
+      return -EINVAL;
+    }
+    else
+    {
+      mode_t mode = op->mode & S_IFMT ? op->mode : op->mode | S_IFREG;
+      inum = create_in(inum_dir, op->name, mode);
+    }
+    if (inum == -1)
+    {
+      return -ENOSPC;
+    }
+    op->ino = inum;
+    return 0;
+  case NUFS_BATCH_UNLINK:
+    if (inum == -1)
+    {
+      return -ENOENT;
+    }
+    return unlink_in(inum_dir, op->name, inum);
+  default:
+    return -EINVAL;
+  }
+}
+
+// applies a batch of creates and unlinks to the directory at path, in
+// order, each getting its own result; returns 0, or -errno if the
+// directory cannot be used
+int storage_batch(const char *path, struct nufs_batch *batch)
+{
+  int inum_dir = tree_lookup(path);
+  if (inum_dir == -1)
+  {
+    return -ENOENT;
+  }
+  if (get_inode(inum_dir)->mode != DIRECTORY_MODE)
+  {
+    return -ENOTDIR;
+  }
+  if (batch->count > NUFS_BULK_MAX)
+  {
+    return -EINVAL;
+  }
+  for (u_int32_t k = 0; k < batch->count; k++)
+  {
+    batch->ops[k].ino = 0;
+    batch->ops[k].result = batch_op(inum_dir, &batch->ops[k]);
+  }
+  return 0;
+}
+
+// opens the file at path, keeping it alive until storage_release even if it
+// is unlinked meanwhile; returns its inum, or -1 if it does not exist
+int storage_open(const char *path)
+{
+  int inum = tree_lookup(path);
+  if (inum != -1)
+  {
+    orphan_open(inum);
+    readahead_open(inum);
+  }
+  return inum;
+}
+
+// checks whether the kernel may keep what it has cached of the file's data
+// across an open, which it may if nothing but writes changed the data since
+// the last open; call once per open
+int storage_keep_cache(int inum)
+{
+  int keep = open_gen[inum] == data_gen[inum];
+  open_gen[inum] = data_gen[inum];
+  return keep;
+}
+
+// closes a file opened with storage_open
+void storage_release(int inum)
+{
+  if (orphan_close(inum) == 0)
+  {
+    // the file is no longer being written, its reserved blocks can go and
+    // its last block can be packed
+    append_forget(inum);
+    if (!(storage_flags & BLOCKS_RDONLY) && !orphan_get(inum))
+    {
+      frag_pack(inum);
+    }
+  }
+}
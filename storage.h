@@ -7,22 +7,43 @@
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
 
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "nufs_ioctl.h"
 #include "slist.h"
-void storage_init(const char *image_path);
+void storage_lock();
+void storage_unlock();
+void storage_wait(pthread_cond_t *cond);
+void storage_timedwait(pthread_cond_t *cond, const struct timespec *until);
+void storage_init(const char *image_path, int stripe_unit, int flags);
+int storage_sync();
+void storage_free();
 char **split_path(const char *path);
 int find_or_create(const char *path, mode_t mode);
+int storage_mkdir(const char *path);
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset);
 int storage_truncate(const char *path, off_t size);
+int storage_fallocate(int inum, int mode, off_t offset, off_t length);
 int storage_unlink(const char *path);
 int storage_link(const char *from, const char *to);
 int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
+int storage_statfs(struct statvfs *st);
+int storage_grow(int count);
+int storage_usage(const char *path, struct nufs_usage *usage);
+int storage_bulkstat(const char *path, struct nufs_bulkstat *bulk);
+int storage_batch(const char *path, struct nufs_batch *batch);
+int storage_open(const char *path);
+int storage_keep_cache(int inum);
+void storage_release(int inum);
 
 #endif
@@ -0,0 +1,127 @@
+/**
+ * @file stream.c
+ *
+ * Reading and writing the export stream format.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "stream.h"
+
+// Compress a block with PackBits: a header byte n of 0..127 is followed by
+// n + 1 literal bytes, one of -127..-1 by a byte repeated 1 - n times.
+int stream_pack(const void *block, void *out)
+{
+  const unsigned char *in = block;
+  signed char *dst = out;
+  int len = 0;
+  int ii = 0;
+  while (ii < BLOCK_SIZE)
+  {
+    int run = 1;
+    while (ii + run < BLOCK_SIZE && run < 128 && in[ii + run] == in[ii])
+    {
+      run++;
+    }
+    if (run >= 3)
+    {
+      dst[len++] = 1 - run;
+      dst[len++] = in[ii];
+      ii += run;
+      continue;
+    }
+    // literals, up to the next run of three
+    int lit = 0;
+    while (ii + lit < BLOCK_SIZE && lit < 128 &&
+           !(ii + lit + 2 < BLOCK_SIZE && in[ii + lit] == in[ii + lit + 1] &&
+             in[ii + lit] == in[ii + lit + 2]))
+    {
+      lit++;
+    }
+    dst[len++] = lit - 1;
+    memcpy(dst + len, in + ii, lit);
+    len += lit;
+    ii += lit;
+  }
+  return len;
+}
+
+// Decompress a block compressed with stream_pack.
+int stream_unpack(const void *in, int len, void *block)
+{
+  const signed char *src = in;
+  unsigned char *out = block;
+  int pos = 0;
+  int ii = 0;
+  while (ii < len)
+  {
+    int n = src[ii++];
+    if (n >= 0)
+    {
+      if (ii + n + 1 > len || pos + n + 1 > BLOCK_SIZE)
+      {
+        return -1;
+      }
+      memcpy(out + pos, src + ii, n + 1);
+      pos += n + 1;
+      ii += n + 1;
+    }
+    else if (n != -128)
+    {
+      if (ii >= len || pos + 1 - n > BLOCK_SIZE)
+      {
+        return -1;
+      }
+      memset(out + pos, (unsigned char)src[ii++], 1 - n);
+      pos += 1 - n;
+    }
+  }
+  return pos == BLOCK_SIZE ? 0 : -1;
+}
+
+// Write the header, filling in its magic, version and crc.
+int stream_write_header(FILE *f, stream_header_t *hdr)
+{
+  hdr->magic = STREAM_MAGIC;
+  hdr->version = STREAM_VERSION;
+  hdr->crc = crc32c(0, hdr, offsetof(stream_header_t, crc));
+  return fwrite(hdr, sizeof(*hdr), 1, f) == 1 ? 0 : -1;
+}
+
+// Read the header and check it.
+int stream_read_header(FILE *f, stream_header_t *hdr)
+{
+  if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != STREAM_MAGIC ||
+      hdr->version != STREAM_VERSION ||
+      hdr->crc != crc32c(0, hdr, offsetof(stream_header_t, crc)))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// Write a record and its data, filling in its crc.
+int stream_write_record(FILE *f, stream_record_t *rec, const void *data)
+{
+  rec->crc = crc32c(0, rec, offsetof(stream_record_t, crc));
+  rec->crc = crc32c(rec->crc, data, rec->len);
+  if (fwrite(rec, sizeof(*rec), 1, f) != 1 ||
+      (rec->len > 0 && fwrite(data, rec->len, 1, f) != 1))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// Read a record and its data and check them.
+int stream_read_record(FILE *f, stream_record_t *rec, void *data)
+{
+  if (fread(rec, sizeof(*rec), 1, f) != 1 || rec->len > STREAM_PACK_MAX ||
+      (rec->len > 0 && fread(data, rec->len, 1, f) != 1))
+  {
+    return -1;
+  }
+  u_int32_t crc = crc32c(0, rec, offsetof(stream_record_t, crc));
+  return crc32c(crc, data, rec->len) == rec->crc ? 0 : -1;
+}
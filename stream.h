@@ -0,0 +1,110 @@
+/**
+ * @file stream.h
+ *
+ * The format export.nufs writes and import.nufs reads: a header describing
+ * the image, then one record per exported block, then an end record.
+ *
+ * Every part carries a CRC-32C. Fields are in host byte order, like the
+ * image itself.
+ */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "blocks.h"
+
+#define STREAM_MAGIC 0x5846554e // "NUFX"
+#define STREAM_VERSION 1
+#define STREAM_END 0xffffffffu // block number of the end record
+
+// record flags
+#define STREAM_ZERO 0x1   // the block is all zeros; no data follows
+#define STREAM_PACKED 0x2 // the data is PackBits compressed
+
+// longest PackBits encoding of a block: one header byte per 128 literals
+#define STREAM_PACK_MAX (BLOCK_SIZE + BLOCK_SIZE / 128)
+
+typedef struct stream_header {
+  u_int32_t magic;
+  u_int32_t version;
+  u_int32_t block_count; // blocks in the image
+  u_int32_t ndevs;       // image files the blocks are striped across
+  u_int32_t stripe_unit;
+  u_int32_t generation; // of the image when it was exported
+  u_int32_t since;      // generation the changes are relative to, 0 if all
+  u_int32_t crc;        // of the fields above
+} stream_header_t;
+
+typedef struct stream_record {
+  u_int32_t bnum;  // block number, or STREAM_END
+  u_int32_t flags; // STREAM_* flags
+  u_int32_t len;   // bytes of data following the record
+  u_int32_t crc;   // of the fields above and the data
+} stream_record_t;
+
+/**
+ * Compress a block with PackBits.
+ *
+ * @param block Block to compress.
+ * @param out Buffer of at least STREAM_PACK_MAX bytes.
+ *
+ * @return Length of the compressed data.
+ */
+int stream_pack(const void *block, void *out);
+
+/**
+ * Decompress a block compressed with stream_pack.
+ *
+ * @param in Compressed data.
+ * @param len Length of the compressed data.
+ * @param block Buffer of BLOCK_SIZE bytes.
+ *
+ * @return 0 on success, -1 if the data does not decode to exactly a block.
+ */
+int stream_unpack(const void *in, int len, void *block);
+
+/**
+ * Write the header, filling in its magic, version and crc.
+ *
+ * @param f Stream to write to.
+ * @param hdr Header with the remaining fields set.
+ *
+ * @return 0 on success, -1 on a write error.
+ */
+int stream_write_header(FILE *f, stream_header_t *hdr);
+
+/**
+ * Read the header and check it.
+ *
+ * @param f Stream to read from.
+ * @param hdr Header to fill in.
+ *
+ * @return 0 on success, -1 if it is short, corrupt or of another version.
+ */
+int stream_read_header(FILE *f, stream_header_t *hdr);
+
+/**
+ * Write a record and its data, filling in its crc.
+ *
+ * @param f Stream to write to.
+ * @param rec Record with the remaining fields set.
+ * @param data rec->len bytes of data.
+ *
+ * @return 0 on success, -1 on a write error.
+ */
+int stream_write_record(FILE *f, stream_record_t *rec, const void *data);
+
+/**
+ * Read a record and its data and check them.
+ *
+ * @param f Stream to read from.
+ * @param rec Record to fill in.
+ * @param data Buffer of at least STREAM_PACK_MAX bytes.
+ *
+ * @return 0 on success, -1 if it is short or corrupt.
+ */
+int stream_read_record(FILE *f, stream_record_t *rec, void *data);
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * @file super.c
+ *
+ * Superblock implementation.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "inode.h"
+#include "super.h"
+
+// where the inode bitmap was kept before images could grow, right after a
+// block bitmap for BLOCK_COUNT blocks
+#define SUPER_OLD_INODE_BITMAP (BLOCK_COUNT / 8)
+
+// Return a pointer to the superblock.
+superblock_t *get_superblock()
+{
+  uint8_t *block = blocks_get_block(0);
+  return (superblock_t *)(block + SUPER_OFFSET);
+}
+
+// Move the inode bitmap of an image made before images could grow out of
+// the way of the block bitmap.
+static void super_upgrade()
+{
+  uint8_t *block = blocks_get_block(0);
+  memcpy(get_inode_bitmap(), block + SUPER_OLD_INODE_BITMAP, INODE_COUNT / 8);
+  memset(block + SUPER_OLD_INODE_BITMAP, 0, INODE_COUNT / 8);
+  blocks_mark_dirty(0);
+  fprintf(stderr, "+ super_upgrade()\n");
+}
+
+// Open the disk image(s) with the geometry recorded in the superblock.
+int super_load(const char *image_path, int stripe_unit, int flags)
+{
+  blocks_init(image_path, stripe_unit, flags);
+
+  // block 0 always lives at the start of the first image, whatever the
+  // stripe unit, so the superblock can be read before the geometry is known
+  superblock_t *sb = get_superblock();
+  if (sb->magic != SUPER_MAGIC)
+  {
+    return 0;
+  }
+  if (sb->stripe_unit != stripe_unit)
+  {
+    fprintf(stderr, "+ super_load: image uses a stripe unit of %d\n",
+            sb->stripe_unit);
+    stripe_unit = sb->stripe_unit;
+    blocks_free();
+    blocks_init(image_path, stripe_unit, flags);
+    sb = get_superblock();
+  }
+  if (sb->ndevs != blocks_device_count())
+  {
+    fprintf(stderr, "+ super_load: image is striped across %d files, got %d\n",
+            sb->ndevs, blocks_device_count());
+    assert(sb->ndevs == blocks_device_count());
+  }
+  if (sb->block_count == 0)
+  {
+    super_upgrade();
+    sb->block_count = BLOCK_COUNT;
+  }
+  int rv = blocks_grow(sb->block_count);
+  assert(rv == 0);
+  return 1;
+}
+
+// Write a fresh superblock for the currently open image(s).
+void super_format()
+{
+  // the image may predate the superblock, and so also the current layout
+  super_upgrade();
+  superblock_t *sb = get_superblock();
+  memset(sb, 0, sizeof(superblock_t));
+  sb->magic = SUPER_MAGIC;
+  sb->state = SUPER_CLEAN;
+  sb->ndevs = blocks_device_count();
+  sb->stripe_unit = blocks_stripe_unit();
+  sb->block_count = blocks_count();
+  super_recount();
+}
+
+// Recompute the free block and inode counters from the bitmaps.
+void super_recount()
+{
+  superblock_t *sb = get_superblock();
+  void *bbm = get_blocks_bitmap();
+  void *ibm = get_inode_bitmap();
+
+  sb->free_blocks = 0;
+  for (int gg = 0; gg < blocks_group_count(); gg++)
+  {
+    sb->group_free[gg] = 0;
+    int end = (gg + 1) * BLOCKS_PER_GROUP;
+    end = end < blocks_count() ? end : blocks_count();
+    for (int ii = gg * BLOCKS_PER_GROUP; ii < end; ii++)
+    {
+      sb->group_free[gg] += !bitmap_get(bbm, ii);
+    }
+    sb->free_blocks += sb->group_free[gg];
+  }
+
+  sb->free_inodes = 0;
+  for (int ii = 0; ii < INODE_COUNT; ii++)
+  {
+    sb->free_inodes += !bitmap_get(ibm, ii);
+  }
+  blocks_mark_dirty(0);
+}
+
+// Grow the volume to the given number of blocks.
+int super_grow(int count)
+{
+  superblock_t *sb = get_superblock();
+  if (count <= blocks_count())
+  {
+    return -EINVAL;
+  }
+  int rv = blocks_grow(count);
+  if (rv != 0)
+  {
+    return rv;
+  }
+  // the new blocks' bits are clear, so they count as free
+  sb->block_count = count;
+  super_recount();
+  return blocks_sync();
+}
+
+// Start a new generation and stamp the groups of written blocks with it.
+void super_track_changes()
+{
+  superblock_t *sb = get_superblock();
+  sb->generation++;
+  blocks_mark_dirty(0);
+  blocks_track_changes(sb->generation);
+}
+
+// Mark the volume as mounted.
+int super_mount()
+{
+  superblock_t *sb = get_superblock();
+  int state = sb->state;
+  sb->state = SUPER_DIRTY;
+  sb->mount_count++;
+  super_track_changes();
+  int rv = blocks_sync();
+  assert(rv == 0);
+  fprintf(stderr, "+ super_mount() -> %s\n",
+          state == SUPER_CLEAN ? "clean" : "dirty");
+  return state;
+}
+
+// Mark the volume as cleanly unmounted.
+void super_unmount()
+{
+  get_superblock()->state = SUPER_CLEAN;
+  blocks_mark_dirty(0);
+}
@@ -0,0 +1,110 @@
+/**
+ * @file super.h
+ *
+ * The superblock: volume-wide state kept in the second half of block 0,
+ * after the block and inode bitmaps.
+ */
+#ifndef SUPER_H
+#define SUPER_H
+
+#include <sys/types.h>
+
+#include "blocks.h"
+#include "csum.h"
+#include "inode.h"
+
+#define SUPER_MAGIC 0x5346554e // "NUFS"
+#define SUPER_OFFSET (BLOCK_SIZE / 2)
+#define SUPER_MAX_GROUPS 256
+
+// superblock states
+#define SUPER_CLEAN 1 // unmounted cleanly, the metadata can be trusted
+#define SUPER_DIRTY 2 // mounted, or crashed while mounted
+
+typedef struct superblock {
+  u_int32_t magic;
+  u_int32_t state;       // SUPER_CLEAN or SUPER_DIRTY
+  u_int32_t mount_count; // number of times the image has been mounted
+  u_int32_t ndevs;       // number of images the blocks are striped across
+  u_int32_t stripe_unit; // blocks per stripe unit
+  u_int32_t free_blocks; // unallocated blocks
+  u_int32_t free_inodes; // unallocated inodes
+  u_int16_t group_free[SUPER_MAX_GROUPS]; // free blocks in each block group
+  u_int8_t orphans[INODE_COUNT / 8]; // unlinked inodes awaiting reclamation
+  u_int32_t block_count; // blocks in the image; 0 in images made before
+                         // they could grow, which have BLOCK_COUNT
+  u_int32_t generation;  // bumped on every mount and every fsck repair
+  u_int32_t group_gen[SUPER_MAX_GROUPS]; // last generation in which a block
+                                         // of each group was written; 0 if
+                                         // not since images tracked it
+  u_int32_t usage_valid; // directory usage totals have been counted
+  u_int32_t csum_valid;  // block checksums have been computed
+  u_int32_t csum_blocks[CSUM_REGIONS]; // checksum block of each region, 0 if
+                                       // none yet
+} superblock_t;
+
+/**
+ * Return a pointer to the superblock.
+ *
+ * @return A pointer to the superblock inside block 0.
+ */
+superblock_t *get_superblock();
+
+/**
+ * Open the disk image(s), switching to the stripe unit and size recorded in
+ * the superblock if the image already has one. Images made before they
+ * could grow have their inode bitmap moved out of the way of the block
+ * bitmap.
+ *
+ * @param image_path Path to the disk image file, or a comma-separated list.
+ * @param stripe_unit Stripe unit to use for an image without a superblock.
+ * @param flags Zero or more BLOCKS_* flags.
+ *
+ * @return 1 if the image has a superblock, 0 if it still needs formatting.
+ */
+int super_load(const char *image_path, int stripe_unit, int flags);
+
+/**
+ * Write a fresh superblock for the currently open image(s).
+ */
+void super_format();
+
+/**
+ * Recompute the free block and inode counters from the bitmaps.
+ *
+ * The counters are kept up to date incrementally by the allocators, so this
+ * is only needed for a new image or after a crash.
+ */
+void super_recount();
+
+/**
+ * Grow the volume to the given number of blocks while it is in use. The new
+ * blocks are free straight away.
+ *
+ * @param count New number of blocks, more than now and at most
+ * BLOCKS_MAX_COUNT.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int super_grow(int count);
+
+/**
+ * Start a new generation, stamping the group of every block written from
+ * now on with it, so an incremental export can find what changed.
+ */
+void super_track_changes();
+
+/**
+ * Mark the volume as mounted and make sure that reaches the disk before
+ * anything else is modified.
+ *
+ * @return The state the volume was in before the mount.
+ */
+int super_mount();
+
+/**
+ * Mark the volume as cleanly unmounted.
+ */
+void super_unmount();
+
+#endif
@@ -2,8 +2,10 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 61;
 use IO::Handle;
+use Errno qw(EEXIST ENOSPC ENOTEMPTY EOPNOTSUPP);
+use Fcntl qw(O_RDONLY O_DIRECTORY);
 
 sub mount {
     system("(make mount 2>&1) >> test.log &");
@@ -41,6 +43,22 @@ sub read_text_slice {
     return $data;
 }
 
+# Applies [op, mode, name] operations to a directory with NUFS_IOC_BATCH and
+# returns the result of each, or just -errno if the call failed.
+sub batch {
+    my ($dir, @ops) = @_;
+    sysopen my $fh, "mnt/$dir", O_RDONLY | O_DIRECTORY or return -$!;
+    my $buf = pack("LL", scalar @ops, 0);
+    $buf .= pack("LLlLZ48", $_->[0], $_->[1], 0, 0, $_->[2]) for @ops;
+    $buf .= "\0" x (4104 - length $buf);
+    # _IOWR('N', 6, struct nufs_batch)
+    my $ok = ioctl($fh, 0xd0084e06, $buf);
+    my $errno = $! + 0;
+    close $fh;
+    return -$errno unless $ok;
+    return map { unpack("x" . (8 + 64 * $_ + 8) . " l", $buf) } 0 .. $#ops;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -66,6 +84,13 @@ my $files = `ls mnt`;
 ok($files =~ /one\.txt/, "one.txt is in the directory");
 ok($files =~ /two\.txt/, "two.txt is in the directory");
 
+my ($total, $free) = split ' ', `stat -f -c '%b %f' mnt`;
+ok(($total == 256 and $free > 0 and $free < $total), "statfs reports free blocks");
+
+system("(./grow.nufs mnt 512 2>&1) >> test.log");
+($total, $free) = split ' ', `stat -f -c '%b %f' mnt`;
+ok($total == 512, "grow.nufs grows the mounted volume");
+
 my $long0 = "=This string is fourty characters long.=" x 50;
 write_text("2k.txt", $long0);
 my $long1 = read_text("2k.txt");
@@ -132,6 +157,13 @@ ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
 
+say "# Timestamps";
+
+my $mtime = (stat("mnt/foo/file.txt"))[9];
+ok(abs($mtime - time()) < 60, "New file has a current mtime");
+utime(1000000000, 1000000000, "mnt/foo/file.txt");
+ok((stat("mnt/foo/file.txt"))[9] == 1000000000, "Set mtime with utime");
+
 unmount();
 
 system("rm -f data.nufs test.log");
@@ -171,5 +203,421 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+unmount();
+
+say "# mkfs.nufs --from";
+system("rm -rf data.nufs mkfs.src");
+system("mkdir -p mkfs.src/sub && echo seeded > mkfs.src/sub/seed.txt");
+system("(./mkfs.nufs --from mkfs.src data.nufs 2>&1) >> test.log");
+mount();
+ok(read_text("sub/seed.txt") eq "seeded", "mkfs.nufs copies a directory tree in");
+my $du = `./du.nufs mnt 2>> test.log`;
+ok($du =~ /^7 bytes\t\d+ blocks\t2 files/, "du.nufs reports the totals beneath a directory");
+unmount();
+system("rm -rf mkfs.src");
+
+say "# export.nufs | import.nufs";
+system("(./export.nufs -z -o data.export data.nufs 2>&1) >> test.log");
+system("rm -f data.nufs");
+system("(./import.nufs -i data.export data.nufs 2>&1) >> test.log");
+mount();
+ok(read_text("sub/seed.txt") eq "seeded", "import.nufs rebuilds an exported image");
+unmount();
+
+say "# -o ro";
+system("(./nufs -s -f -o ro mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+write_text("ro.txt", "nope");
+ok((read_text("sub/seed.txt") eq "seeded" and !-e "mnt/ro.txt"),
+   "read-only mount reads but does not write");
+unmount();
+system("rm -f data.export");
+
+say "# -o trace, replay.nufs";
+system("rm -f data.nufs");
+system("(./nufs -s -f -o trace=data.trace mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+system("mkdir mnt/traced");
+write_text("traced/one.txt", "hello, trace");
+unmount();
+system("rm -f data.nufs");
+my $replay = `./replay.nufs -f data.trace data.nufs 2>> test.log`;
+ok(($replay =~ /^write\s+[1-9]\d*\s+\S+\s+\S+\s+0$/m and
+    $replay =~ /^mkdir\s+1\s+\S+\s+\S+\s+0$/m),
+   "replay.nufs plays a captured trace back onto a new image");
+system("rm -f data.nufs data.trace");
+
+say "# -o dedup, dedupstat.nufs";
+system("(./nufs -s -f -o dedup mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+system("head -c 65536 /dev/urandom > mnt/one.bin && cp mnt/one.bin mnt/two.bin");
+my $stat = `./dedupstat.nufs mnt 2>> test.log`;
+ok(($stat =~ /^referenced blocks: 32$/m and $stat =~ /^stored blocks:\s+16$/m and
+    system("cmp -s mnt/one.bin mnt/two.bin") == 0),
+   "identical files share their blocks under -o dedup");
+unmount();
+system("rm -f data.nufs");
+
+say "# ls.nufs";
+mount();
+system("mkdir mnt/bulk && echo hi > mnt/bulk/a.txt && mkdir mnt/bulk/b");
+my $ls = `./ls.nufs mnt/bulk 2>> test.log`;
+ok(($ls =~ /^\d+\t100\d+\t1\t3\t.*\ta\.txt$/m and $ls =~ /^\d+\t040\d+\t.*\tb$/m and
+    $ls !~ /\t\.\.?$/m),
+   "ls.nufs lists a directory with its attributes");
+unmount();
+system("rm -f data.nufs");
+
+say "# scrub.nufs";
+mount();
+system("perl -e 'print \"scrubme!\" x 512' > mnt/victim.txt");
+unmount();
+my $clean = system("(./scrub.nufs data.nufs 2>&1) >> test.log") >> 8;
+{
+    open my $fh, "+<", "data.nufs" or die;
+    binmode $fh;
+    local $/;
+    my $img = <$fh>;
+    my $at = index($img, "scrubme!" x 8);
+    seek($fh, $at + 10, 0);
+    print $fh "X";
+    close $fh;
+}
+my $scrub = `./scrub.nufs data.nufs 2>> test.log`;
+ok(($clean == 0 and $? >> 8 == 4 and $scrub =~ /damaged, data of inode \d+ \/victim\.txt$/m),
+   "scrub.nufs finds a damaged block and the file it belongs to");
+system("rm -f data.nufs");
+
+say "# truncate-extend, then append";
+mount();
+write_text("stale.txt", "X" x 12288);
+truncate("mnt/stale.txt", 0);
+system("touch mnt/holey.txt");
+truncate("mnt/holey.txt", 5000);
+{
+    open my $fh, ">>", "mnt/holey.txt" or die;
+    print $fh "hi";
+}
+my $holey = read_text("holey.txt");
+ok($holey eq ("\0" x 5000) . "hi", "a hole left by truncate reads back as zeros after an append");
+unmount();
+system("rm -f data.nufs");
+
+say "# fallocate";
+mount();
+system("perl -e 'print \"P\" x 12288' > mnt/punch.txt");
+my (undef, $free0) = split ' ', `stat -f -c '%b %f' mnt`;
+system("fallocate -p -o 4096 -l 8192 mnt/punch.txt");
+my (undef, $free1) = split ' ', `stat -f -c '%b %f' mnt`;
+ok((read_text_slice("punch.txt", 4096, 0) eq "P" x 4096 and
+    read_text_slice("punch.txt", 8192, 4096) eq "\0" x 8192 and
+    -s "mnt/punch.txt" == 12288 and $free1 - $free0 == 3),
+   "punching a hole reads back as zeros and frees its blocks");
+system("perl -e 'print \"Z\" x 8192' > mnt/zero.txt");
+system("fallocate -z -o 100 -l 5000 mnt/zero.txt");
+ok((read_text_slice("zero.txt", 100, 0) eq "Z" x 100 and
+    read_text_slice("zero.txt", 5000, 100) eq "\0" x 5000 and
+    read_text_slice("zero.txt", 3092, 5100) eq "Z" x 3092),
+   "zeroing a range reads back as zeros");
+system("fallocate -n -l 16384 mnt/prealloc.txt");
+my $presize = -s "mnt/prealloc.txt";
+truncate("mnt/prealloc.txt", 16384);
+ok(($presize == 0 and read_text_slice("prealloc.txt", 16384, 0) eq "\0" x 16384),
+   "blocks preallocated past the end read back as zeros");
+unmount();
+system("rm -f data.nufs");
+
+say "# tail packing";
+mount();
+my (undef, $tfree0) = split ' ', `stat -f -c '%b %f' mnt`;
+for my $i (0 .. 9) {
+    open my $fh, ">", "mnt/tail$i.txt" or die;
+    print $fh chr(97 + $i) x (1000 + 200 * $i);
+    close $fh;
+}
+my (undef, $tfree1) = split ' ', `stat -f -c '%b %f' mnt`;
+ok($tfree0 - $tfree1 < 10, "closed small files share blocks");
+{
+    open my $fh, ">>", "mnt/tail3.txt" or die;
+    print $fh "+" x 4000;
+    close $fh;
+}
+unmount();
+mount();
+my $tails_ok = 1;
+for my $i (0 .. 9) {
+    my $want = chr(97 + $i) x (1000 + 200 * $i);
+    $want .= "+" x 4000 if $i == 3;
+    open my $fh, "<", "mnt/tail$i.txt" or die;
+    local $/ = undef;
+    my $got = <$fh>;
+    close $fh;
+    $tails_ok = 0 unless defined $got and $got eq $want;
+}
+ok($tails_ok, "packed files read back after growing one past its tail and remounting");
+unmount();
+system("rm -f data.nufs");
 
+say "# export.nufs -s after a crash";
+mount();
+system("head -c 300000 /dev/urandom > mnt/big.bin && mkdir mnt/sub");
+system("head -c 200000 /dev/urandom > mnt/filler.bin");
+system("head -c 250000 /dev/urandom > mnt/sub/grown.bin");
+unmount();
+my $full = `./export.nufs -o data.export data.nufs 2>&1`;
+my $gen = ($full =~ /generation (\d+)/)[0] // 0;
+system("(./import.nufs -i data.export copy.nufs 2>&1) >> test.log");
+mount();
+system("head -c 100000 /dev/urandom >> mnt/sub/grown.bin");
+system("pkill -9 -x nufs");
+unmount();
+# the next mount recomputes the checksums and the totals beneath sub
+mount();
+unmount();
+system("(./export.nufs -s $gen -o data.export data.nufs 2>&1) >> test.log");
+system("(./import.nufs -i data.export copy.nufs 2>&1) >> test.log");
+my $copy_scrub = system("(./scrub.nufs copy.nufs 2>&1) >> test.log") >> 8;
+system("mv copy.nufs data.nufs");
+mount();
+my $copy_du = `./du.nufs mnt/sub 2>> test.log`;
+ok(($copy_scrub == 0 and $copy_du =~ /^350000 bytes\t/),
+   "an incremental export after a crash carries what the next mount recomputed");
+unmount();
+system("rm -f data.nufs data.export");
+
+say "# NUFS_IOC_BATCH";
+mount();
+system("mkdir -p mnt/batch/full && touch mnt/batch/old.txt mnt/batch/full/x");
+my @refused = batch("batch", [1, 0644, "new.txt"]);
+unmount();
+system("(./nufs -s -f -o batch mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+# looked up first, so that anything the kernel kept would be stale
+my @before = (-e "mnt/batch/new.txt", -e "mnt/batch/old.txt");
+my @results = batch("batch", [1, 0644, "new.txt"], [2, 0, "newdir"],
+                    [3, 0, "old.txt"], [1, 0644, "new.txt"], [3, 0, "full"]);
+ok((@refused == 1 and $refused[0] == -EOPNOTSUPP),
+   "a batch is refused while the kernel caches names");
+ok((!$before[0] and $before[1] and
+    "@results" eq join(" ", 0, 0, 0, -EEXIST, -ENOTEMPTY) and
+    -f "mnt/batch/new.txt" and -d "mnt/batch/newdir" and
+    !-e "mnt/batch/old.txt" and -d "mnt/batch/full"),
+   "a batch applies each operation and the mount sees the changes");
+unmount();
+system("rm -f data.nufs");
+
+say "# link into a full directory";
+mount();
+system("mkdir mnt/full && touch mnt/linked.txt");
+my $links = 0;
+$links++ while $links < 1000 and link("mnt/linked.txt", "mnt/full/l$links");
+my $link_errno = $! + 0;
+ok(($links > 0 and $links < 1000 and $link_errno == ENOSPC and
+    -e "mnt/full/l0" and !-e "mnt/full/l$links"),
+   "linking into a full directory fails with ENOSPC");
+unmount();
+system("rm -f data.nufs");
+
+say "# fsck.nufs";
+mount();
+write_text("checked.txt", "still here");
+my ($checked_inum) = `./ls.nufs mnt 2>> test.log` =~ /^(\d+)\t.*\tchecked\.txt$/m;
+unmount();
+my $fsck_clean = system("(./fsck.nufs -f data.nufs 2>&1) >> test.log") >> 8;
+{
+    # block 0 holds the block bitmap, and the superblock from byte 2048 with
+    # its orphan list 540 bytes in; block 1 is the inode table, 32 bytes an
+    # inode with ref_count 2 bytes in
+    open my $fh, "+<", "data.nufs" or die;
+    binmode $fh;
+    my $poke = sub {
+        my ($at, $pack, $value) = @_;
+        seek($fh, $at, 0);
+        print $fh pack($pack, $value);
+    };
+    $poke->(4096 + 32 * ($checked_inum // 0) + 2, "S", 5);
+    $poke->(200 / 8, "C", 1 << 200 % 8);
+    $poke->(2048 + 540 + 100 / 8, "C", 1 << 100 % 8);
+    close $fh;
+}
+my $fsck_n = system("(./fsck.nufs -n -f data.nufs 2>&1) >> test.log") >> 8;
+my $fsck_y = `./fsck.nufs -y -f data.nufs 2>> test.log`;
+my $fsck_y_status = $? >> 8;
+my $fsck_after = system("(./fsck.nufs -n -f data.nufs 2>&1) >> test.log") >> 8;
+mount();
+ok(($fsck_clean == 0 and $fsck_n == 4 and $fsck_y_status == 1 and $fsck_after == 0 and
+    $fsck_y =~ /^inode \d+: ref_count is 5, but 1 entries name it \(fixed\)$/m and
+    $fsck_y =~ /^block 200 is marked in use but nothing claims it \(fixed\)$/m and
+    $fsck_y =~ /^free inode 100 is on the orphan list \(fixed\)$/m and
+    read_text("checked.txt") eq "still here"),
+   "fsck.nufs reports damage with -n and repairs it with -y");
+unmount();
+system("rm -f data.nufs missing.nufs");
+my $missing_y = system("(./fsck.nufs -y missing.nufs 2>&1) >> test.log") >> 8;
+my $missing_n = system("(./fsck.nufs -n missing.nufs 2>&1) >> test.log") >> 8;
+ok(($missing_y == 8 and $missing_n == 8 and !-e "missing.nufs"),
+   "fsck.nufs fails on a missing image without creating it");
+
+say "# -o hot_meta, readahead";
+system("head -c 1048576 /dev/urandom > readahead.src");
+mount();
+system("cp readahead.src mnt/readahead.bin");
+unmount();
+my $hot_mount = sub {
+    system("(./nufs -s -f -o hot_meta mnt data.nufs 2>&1) >> test.log &");
+    sleep 1;
+};
+$hot_mount->();
+my $random_ok = 1;
+{
+    open my $src, "<", "readahead.src" or die;
+    binmode $src;
+    for my $at (917504, 12288, 528384, 4096 * 200 + 100, 65536, 1040384) {
+        my $want;
+        seek $src, $at, 0;
+        read $src, $want, 4096;
+        $random_ok = 0 unless read_text_slice("readahead.bin", 4096, $at) eq $want;
+    }
+    close $src;
+}
+unmount();
+$hot_mount->();
+my $sequential = system("cmp -s readahead.src mnt/readahead.bin");
+unmount();
+my $hot_logged = `grep -c 'storage_hot_meta()' test.log`;
+ok(($random_ok and $sequential == 0 and $hot_logged >= 2),
+   "a file reads back at random and in order under -o hot_meta");
+system("rm -f data.nufs readahead.src");
+
+say "# -o io_uring";
+system("head -c 300000 /dev/urandom > uring.src");
+system("(./nufs -s -f -o io_uring mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+system("cp uring.src mnt/before.bin");
+system("(./grow.nufs mnt 512 2>&1) >> test.log");
+system("cp uring.src mnt/after.bin");
+unmount();
+mount();
+ok((system("cmp -s uring.src mnt/before.bin") == 0 and
+    system("cmp -s uring.src mnt/after.bin") == 0),
+   "files written under -o io_uring, before and after a grow, read back");
+unmount();
+system("rm -f data.nufs uring.src");
+
+say "# striping, -o stripe_unit";
+system("rm -f img0.nufs img1.nufs");
+system("head -c 200000 /dev/urandom > stripe.src");
+my $striped_mount = sub {
+    system("(./nufs -s -f -o stripe_unit=2 mnt img0.nufs,img1.nufs 2>&1) >> test.log &");
+    sleep 1;
+};
+$striped_mount->();
+system("cp stripe.src mnt/striped.bin");
+unmount();
+my ($in0, $in1, $stripe_blocks) = (0, 0, 0);
+{
+    local $/ = undef;
+    my @imgs;
+    for my $name ("stripe.src", "img0.nufs", "img1.nufs") {
+        open my $fh, "<", $name or die;
+        binmode $fh;
+        push @imgs, <$fh>;
+        close $fh;
+    }
+    my ($src, $img0, $img1) = @imgs;
+    for (my $at = 0; $at + 4096 <= length $src; $at += 4096) {
+        my $chunk = substr($src, $at, 4096);
+        $stripe_blocks++;
+        $in0++ if index($img0, $chunk) >= 0;
+        $in1++ if index($img1, $chunk) >= 0;
+    }
+}
+$striped_mount->();
+ok(($in0 > 0 and $in1 > 0 and $in0 + $in1 == $stripe_blocks and
+    system("cmp -s stripe.src mnt/striped.bin") == 0),
+   "a file striped over two images lands in both and reads back");
+unmount();
+system("rm -f img0.nufs img1.nufs stripe.src");
+
+say "# unlink while open, reclaim";
+mount();
+my (undef, $ofree0) = split ' ', `stat -f -c '%b %f' mnt`;
+system("perl -e 'print \"D\" x 200000' > mnt/doomed.bin");
+my ($doomed_head, $doomed_back) = ("", "");
+open my $doomed, "+<", "mnt/doomed.bin" or die;
+unlink("mnt/doomed.bin");
+my $doomed_gone = !-e "mnt/doomed.bin";
+read $doomed, $doomed_head, 16;
+seek $doomed, 100000, 0;
+print $doomed "still writable";
+seek $doomed, 100000, 0;
+read $doomed, $doomed_back, 14;
+my (undef, $ofree1) = split ' ', `stat -f -c '%b %f' mnt`;
+close $doomed;
+# reclaimed in the background after the release
+my $ofree2 = 0;
+for (1 .. 50) {
+    (undef, $ofree2) = split ' ', `stat -f -c '%b %f' mnt`;
+    last if $ofree2 >= $ofree0 - 1;
+    select(undef, undef, undef, 0.1);
+}
+ok(($doomed_gone and $doomed_head eq "D" x 16 and $doomed_back eq "still writable" and
+    $ofree1 < $ofree0 - 40 and $ofree2 >= $ofree0 - 1),
+   "an unlinked file stays usable while open and its space comes back after");
+unmount();
+system("rm -f data.nufs");
+
+say "# -o discard";
+system("(./nufs -s -f -o discard mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+system("head -c 600000 /dev/urandom > mnt/discarded.bin && sync");
+my $held = (stat "data.nufs")[12];
+unlink("mnt/discarded.bin");
+# punched in the background, after the freed blocks are synced
+my $left = $held;
+for (1 .. 30) {
+    select(undef, undef, undef, 0.5);
+    $left = (stat "data.nufs")[12];
+    last if $held - $left >= 1000;
+}
+ok($held - $left >= 1000, "freeing a file under -o discard shrinks the image on the host");
+unmount();
+system("rm -f data.nufs");
+
+say "# defragment.nufs";
+system("head -c 163840 /dev/urandom > frag_a.src && head -c 163840 /dev/urandom > frag_b.src");
+mount();
+{
+    # a block of one file, then one of the other, so neither is contiguous
+    open my $sa, "<", "frag_a.src" or die;
+    open my $sb, "<", "frag_b.src" or die;
+    open my $da, ">", "mnt/frag_a.bin" or die;
+    open my $db, ">", "mnt/frag_b.bin" or die;
+    binmode $_ for $sa, $sb, $da, $db;
+    $da->autoflush(1);
+    $db->autoflush(1);
+    my $chunk;
+    while (read($sa, $chunk, 4096)) {
+        print $da $chunk;
+        read($sb, $chunk, 4096);
+        print $db $chunk;
+    }
+    close $_ for $sa, $sb, $da, $db;
+}
+system("(./defragment.nufs mnt 2>&1) >> test.log");
+my $pass = "";
+for (1 .. 50) {
+    ($pass) = `grep 'defrag_pass()' test.log` =~ /(\d+) blocks, \d+ directories\n\z/;
+    last if defined $pass;
+    select(undef, undef, undef, 0.1);
+}
+my $frag_same = system("cmp -s frag_a.src mnt/frag_a.bin") == 0 &&
+                system("cmp -s frag_b.src mnt/frag_b.bin") == 0;
+unmount();
+mount();
+ok((($pass // 0) > 0 and $frag_same and
+    system("cmp -s frag_a.src mnt/frag_a.bin") == 0 and
+    system("cmp -s frag_b.src mnt/frag_b.bin") == 0),
+   "defragment.nufs moves the blocks of interleaved files and keeps their contents");
+unmount();
+system("rm -f data.nufs frag_a.src frag_b.src");
@@ -0,0 +1,130 @@
+/**
+ * @file trace.c
+ *
+ * Writing and reading operation traces.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_BUFFER (1 << 20) // bytes buffered before a write to the file
+
+static const char *trace_names[TRACE_OP_COUNT] = {
+    "access", "getattr",   "readdir", "mknod",   "mkdir", "link",
+    "unlink", "rmdir",     "rename",  "truncate", "fallocate", "open",
+    "release", "read",     "write",   "statfs",  "fsync", "utimens",
+};
+
+static FILE *trace_file = NULL;
+static u_int64_t trace_epoch = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Name of an operation.
+const char *trace_op_name(trace_op_t op)
+{
+  return op < TRACE_OP_COUNT ? trace_names[op] : "?";
+}
+
+// Monotonic time in ns.
+u_int64_t trace_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Start capturing to the given file.
+int trace_open(const char *path)
+{
+  trace_file = fopen(path, "w");
+  if (trace_file == NULL)
+  {
+    return -errno;
+  }
+  setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER);
+  trace_header_t hdr = {.magic = TRACE_MAGIC, .version = TRACE_VERSION};
+  fwrite(&hdr, sizeof(hdr), 1, trace_file);
+  trace_epoch = trace_now();
+  fprintf(stderr, "+ trace_open(%s)\n", path);
+  return 0;
+}
+
+// Check whether a capture is running.
+int trace_active() { return trace_file != NULL; }
+
+// Record an operation that has just finished.
+void trace_record(trace_record_t *rec, const char *path, const char *path2,
+                  u_int64_t start)
+{
+  u_int64_t end = trace_now();
+  rec->start = start - trace_epoch;
+  rec->duration = end - start;
+  rec->_pad = 0;
+  rec->_pad2 = 0;
+  rec->path_len = strlen(path);
+  rec->path2_len = path2 != NULL ? strlen(path2) : 0;
+  pthread_mutex_lock(&trace_lock);
+  if (trace_file != NULL)
+  {
+    fwrite(rec, sizeof(*rec), 1, trace_file);
+    fwrite(path, 1, rec->path_len, trace_file);
+    if (path2 != NULL)
+    {
+      fwrite(path2, 1, rec->path2_len, trace_file);
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// Finish the capture.
+void trace_close()
+{
+  pthread_mutex_lock(&trace_lock);
+  if (trace_file != NULL)
+  {
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// Open a trace file for reading and check its header.
+FILE *trace_read_open(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  trace_header_t hdr;
+  if (f == NULL)
+  {
+    return NULL;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC ||
+      hdr.version != TRACE_VERSION)
+  {
+    fclose(f);
+    errno = EINVAL;
+    return NULL;
+  }
+  return f;
+}
+
+// Read the next record of a trace.
+int trace_read(FILE *f, trace_record_t *rec, char *path, char *path2)
+{
+  if (fread(rec, sizeof(*rec), 1, f) != 1)
+  {
+    return 0;
+  }
+  if (rec->op >= TRACE_OP_COUNT ||
+      fread(path, 1, rec->path_len, f) != rec->path_len ||
+      fread(path2, 1, rec->path2_len, f) != rec->path2_len)
+  {
+    return -1;
+  }
+  path[rec->path_len] = '\0';
+  path2[rec->path2_len] = '\0';
+  return 1;
+}
@@ -0,0 +1,134 @@
+/**
+ * @file trace.h
+ *
+ * Capture of the operations a mount serves (the trace mount option), for
+ * replay.nufs to play back later.
+ *
+ * A trace file is a trace_header_t followed by one trace_record_t per
+ * operation, each followed by its path and, for link and rename, the second
+ * path, without terminating NULs. Data is not recorded, only offsets and
+ * sizes. Fields are in host byte order.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define TRACE_MAGIC 0x5254554e // "NUTR"
+#define TRACE_VERSION 1
+#define TRACE_NO_FH 0xffffffffu // the operation was not on an open file
+
+typedef enum trace_op {
+  TRACE_ACCESS,
+  TRACE_GETATTR,
+  TRACE_READDIR,
+  TRACE_MKNOD,
+  TRACE_MKDIR,
+  TRACE_LINK,
+  TRACE_UNLINK,
+  TRACE_RMDIR,
+  TRACE_RENAME,
+  TRACE_TRUNCATE,
+  TRACE_FALLOCATE,
+  TRACE_OPEN,
+  TRACE_RELEASE,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_STATFS,
+  TRACE_FSYNC,
+  TRACE_UTIMENS,
+  TRACE_OP_COUNT,
+} trace_op_t;
+
+typedef struct trace_header {
+  u_int32_t magic;
+  u_int32_t version;
+} trace_header_t;
+
+typedef struct trace_record {
+  u_int64_t start;    // ns since the capture started
+  u_int64_t offset;   // read, write and fallocate
+  u_int64_t size;     // read, write, truncate and fallocate
+  u_int32_t duration; // ns the operation took
+  int32_t result;     // what it returned
+  u_int32_t fh;       // file handle of the open file, or TRACE_NO_FH
+  u_int32_t mode;     // mknod, fallocate and access
+  u_int8_t op;        // a trace_op_t
+  u_int8_t _pad;
+  u_int16_t path_len;
+  u_int16_t path2_len;
+  u_int16_t _pad2;
+} trace_record_t;
+
+/**
+ * Return the names of the operations, indexed by trace_op_t.
+ *
+ * @param op The operation.
+ *
+ * @return Its name, e.g. "getattr".
+ */
+const char *trace_op_name(trace_op_t op);
+
+/**
+ * Return the time to pass to trace_record as the start of an operation.
+ *
+ * @return Monotonic time in ns.
+ */
+u_int64_t trace_now();
+
+/**
+ * Start capturing to the given file, replacing it.
+ *
+ * @param path File to write the trace to.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int trace_open(const char *path);
+
+/**
+ * Check whether a capture is running.
+ *
+ * @return 1 if it is, 0 if not.
+ */
+int trace_active();
+
+/**
+ * Record an operation that has just finished. Thread safe.
+ *
+ * @param rec Record with op, offset, size, fh, mode and result filled in;
+ * the rest is filled in here.
+ * @param path Path the operation was on.
+ * @param path2 Second path (link and rename), or NULL.
+ * @param start trace_now() from before the operation.
+ */
+void trace_record(trace_record_t *rec, const char *path, const char *path2,
+                  u_int64_t start);
+
+/**
+ * Finish the capture, writing out what is buffered.
+ */
+void trace_close();
+
+/**
+ * Open a trace file for reading and check its header.
+ *
+ * @param path Trace file.
+ *
+ * @return The open file, or NULL if it cannot be read or is not a trace.
+ */
+FILE *trace_read_open(const char *path);
+
+/**
+ * Read the next record of a trace.
+ *
+ * @param f Trace opened with trace_read_open.
+ * @param rec Record to fill in.
+ * @param path Buffer of at least 64KB for the path.
+ * @param path2 Buffer of at least 64KB for the second path.
+ *
+ * @return 1 if a record was read, 0 at the end, -1 if the trace is corrupt.
+ */
+int trace_read(FILE *f, trace_record_t *rec, char *path, char *path2);
+
+#endif
@@ -0,0 +1,267 @@
+/**
+ * @file uring.c
+ *
+ * Implementation of the io_uring wrapper, talking to the kernel through the
+ * raw syscalls so there is no dependency on liburing.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static int ring_fd = -1;
+static char *ring_buf = 0;
+static size_t ring_buf_size = 0;
+
+static void *sq_ring = 0;
+static size_t sq_ring_size = 0;
+static unsigned *sq_head;
+static unsigned *sq_tail;
+static unsigned *sq_mask;
+static unsigned *sq_array;
+static struct io_uring_sqe *sqes = 0;
+static size_t sqes_size = 0;
+
+static void *cq_ring = 0;
+static size_t cq_ring_size = 0;
+static unsigned *cq_head;
+static unsigned *cq_tail;
+static unsigned *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Set up the ring and register the files and buffer with the kernel.
+int uring_init(const int *fds, int nfds, void *buf, size_t size)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_fd = sys_io_uring_setup(URING_DEPTH, &p);
+  if (ring_fd < 0)
+  {
+    return -errno;
+  }
+
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring_fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+  {
+    int err = -errno;
+    uring_free();
+    return err;
+  }
+
+  sq_head = (unsigned *)((char *)sq_ring + p.sq_off.head);
+  sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+  sq_mask = (unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+  sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+  cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+  cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+  cq_mask = (unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+
+  // fixed buffer 0 is the only one we ever use
+  struct iovec iov = {.iov_base = buf, .iov_len = size};
+  if (sys_io_uring_register(ring_fd, IORING_REGISTER_FILES, (void *)fds,
+                            nfds) < 0 ||
+      sys_io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+  {
+    int err = -errno;
+    uring_free();
+    return err;
+  }
+  ring_buf = buf;
+  ring_buf_size = size;
+
+  fprintf(stderr, "+ uring_init(%d files, %zu bytes) -> %d\n", nfds, size,
+          ring_fd);
+  return 0;
+}
+
+// Register a different length of the buffer given to uring_init.
+int uring_resize(size_t size)
+{
+  struct iovec iov = {.iov_base = ring_buf, .iov_len = size};
+  if (sys_io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0) < 0)
+  {
+    return -errno;
+  }
+  if (sys_io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+  {
+    // e.g. over the locked memory limit; keep going with the old size
+    int err = -errno;
+    iov.iov_len = ring_buf_size;
+    sys_io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1);
+    return err;
+  }
+  ring_buf_size = size;
+  fprintf(stderr, "+ uring_resize(%zu bytes)\n", size);
+  return 0;
+}
+
+// Fill in the next submission queue entry for the given request.
+static void uring_prep(const uring_req_t *req, unsigned idx)
+{
+  unsigned tail = *sq_tail;
+  unsigned slot = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+
+  sqe->fd = req->file;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->user_data = idx;
+  switch (req->op)
+  {
+  case URING_READ:
+  case URING_WRITE:
+    sqe->opcode =
+        req->op == URING_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+    sqe->addr = (unsigned long)(ring_buf + req->buf_off);
+    sqe->len = req->len;
+    sqe->off = req->file_off;
+    sqe->buf_index = 0;
+    break;
+  case URING_FSYNC:
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags |= IOSQE_IO_DRAIN;
+    break;
+  case URING_DISCARD:
+    // fallocate takes its length in addr and its mode in len
+    sqe->opcode = IORING_OP_FALLOCATE;
+    sqe->addr = req->len;
+    sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    sqe->off = req->file_off;
+    break;
+  }
+
+  sq_array[slot] = slot;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Submit the given requests and wait for all of them to complete.
+int uring_submit(const uring_req_t *reqs, int count)
+{
+  int rv = 0;
+  for (int done = 0; done < count;)
+  {
+    int batch = count - done < URING_DEPTH ? count - done : URING_DEPTH;
+    for (int i = 0; i < batch; i++)
+    {
+      uring_prep(&reqs[done + i], done + i);
+    }
+
+    int submitted = 0;
+    int failed = 0;
+    while (submitted < batch)
+    {
+      int ret = sys_io_uring_enter(ring_fd, batch - submitted, batch - submitted,
+                                   IORING_ENTER_GETEVENTS);
+      if (ret < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        // take back the requests the kernel did not pick up, and wait for
+        // those it did, so no completion is left for a later call to reap
+        failed = -errno;
+        __atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+        batch = submitted;
+        break;
+      }
+      submitted += ret;
+    }
+
+    int reaped = 0;
+    while (reaped < batch)
+    {
+      unsigned head = *cq_head;
+      if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+      {
+        sys_io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+        continue;
+      }
+      struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+      const uring_req_t *req = &reqs[cqe->user_data];
+      if (cqe->res < 0)
+      {
+        rv = cqe->res;
+      }
+      else if ((req->op == URING_READ || req->op == URING_WRITE) &&
+               (size_t)cqe->res != req->len)
+      {
+        rv = -EIO;
+      }
+      __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+      reaped++;
+    }
+    if (failed != 0)
+    {
+      rv = failed;
+      break;
+    }
+    done += batch;
+  }
+  fprintf(stderr, "+ uring_submit(%d) -> %d\n", count, rv);
+  return rv;
+}
+
+// Unregister the files and buffer and tear down the ring.
+void uring_free()
+{
+  if (sqes != 0 && sqes != MAP_FAILED)
+  {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring != 0 && cq_ring != MAP_FAILED)
+  {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring != 0 && sq_ring != MAP_FAILED)
+  {
+    munmap(sq_ring, sq_ring_size);
+  }
+  if (ring_fd >= 0)
+  {
+    close(ring_fd);
+  }
+  sqes = 0;
+  cq_ring = 0;
+  sq_ring = 0;
+  ring_fd = -1;
+  ring_buf = 0;
+  ring_buf_size = 0;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file uring.h
+ *
+ * A minimal io_uring wrapper used by the block layer.
+ *
+ * The ring is bound to a small set of fixed files and a single registered
+ * buffer, so every request is expressed as an offset into that buffer, a
+ * file index and an offset into that file. Requests are submitted in batches
+ * with one io_uring_enter.
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define URING_DEPTH 64
+
+typedef enum uring_op {
+  URING_READ,
+  URING_WRITE,
+  URING_FSYNC,
+  URING_DISCARD, // punch a hole in the file, freeing its storage
+} uring_op_t;
+
+typedef struct uring_req {
+  uring_op_t op;
+  int file;       // index into the files given to uring_init
+  size_t buf_off; // offset into the registered buffer (reads and writes)
+  size_t len;     // number of bytes to transfer
+  off_t file_off; // offset into the fixed file
+} uring_req_t;
+
+/**
+ * Set up the ring and register the files and buffer with the kernel.
+ *
+ * @param fds Files the requests operate on.
+ * @param nfds Number of files.
+ * @param buf Buffer all transfers go to or come from.
+ * @param size Size of the buffer in bytes.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int uring_init(const int *fds, int nfds, void *buf, size_t size);
+
+/**
+ * Register a different length of the buffer given to uring_init, e.g.
+ * after the files have grown. Must not be called with requests in flight.
+ *
+ * @param size New size of the buffer in bytes.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int uring_resize(size_t size);
+
+/**
+ * Submit the given requests and wait for all of them to complete.
+ *
+ * Batches larger than the ring depth are split into several submissions.
+ * An URING_FSYNC request is drained, so it covers every write before it to
+ * its file.
+ *
+ * @param reqs Requests to submit.
+ * @param count Number of requests.
+ *
+ * @return 0 if every request succeeded, and every read and write transferred
+ * its full length, -errno otherwise.
+ */
+int uring_submit(const uring_req_t *reqs, int count);
+
+/**
+ * Unregister the files and buffer and tear down the ring.
+ */
+void uring_free();
+
+#endif
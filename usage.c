@@ -0,0 +1,257 @@
+/**
+ * @file usage.c
+ *
+ * Recursive directory usage totals.
+ *
+ * Each inode contributes to every directory that names it: a file its size,
+ * its blocks and 1 entry, a directory its own totals plus its block and 1
+ * entry. contrib[] is what each inode has contributed so far, so a change
+ * is carried up as the difference from that; it also makes the order in
+ * which changes are carried up unimportant. All of this is memory only and
+ * rebuilt at mount.
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "directory.h"
+#include "inode.h"
+#include "super.h"
+#include "usage.h"
+
+typedef struct usage {
+  int64_t bytes;
+  int64_t blocks;
+  int64_t files;
+} usage_t;
+
+static int usage_active = 0;
+static usage_t contrib[INODE_COUNT];
+// number of entries in each directory naming each inode, as [inum][dir]
+static u_int8_t links[INODE_COUNT][INODE_COUNT];
+static u_int8_t dirty[INODE_COUNT / 8];
+
+static dirhead_t *usage_head(int dir)
+{
+  return directory_head(blocks_get_block(get_inode(dir)->block));
+}
+
+// Count the blocks a file holds, including its indirect block.
+static int usage_blocks(inode_t *node)
+{
+  int count = (node->block != 0) + (node->iblock != 0);
+  if (node->iblock != 0)
+  {
+    u_int32_t *ptrs = blocks_get_block(node->iblock);
+    for (int ii = 0; ii < INODE_PTRS; ++ii)
+    {
+      count += ptrs[ii] != 0;
+    }
+  }
+  return count;
+}
+
+// What an inode would contribute to the directories naming it now.
+static usage_t usage_current(int inum)
+{
+  inode_t *node = get_inode(inum);
+  usage_t now = {0, 0, 1};
+  if (node->mode == DIRECTORY_MODE)
+  {
+    dirhead_t *dir = usage_head(inum);
+    now.bytes = dir->du_bytes;
+    now.blocks = dir->du_blocks + 1;
+    now.files += dir->du_files;
+  }
+  else
+  {
+    now.bytes = node->size;
+    now.blocks = usage_blocks(node);
+  }
+  return now;
+}
+
+// Add a change in what inum contributes to every directory above it.
+static void usage_carry(int inum, int64_t bytes, int64_t blocks, int64_t files)
+{
+  contrib[inum].bytes += bytes;
+  contrib[inum].blocks += blocks;
+  contrib[inum].files += files;
+  for (int dir = 0; dir < INODE_COUNT; dir++)
+  {
+    int count = links[inum][dir];
+    if (count == 0)
+    {
+      continue;
+    }
+    dirhead_t *head = usage_head(dir);
+    head->du_bytes += count * bytes;
+    head->du_blocks += count * blocks;
+    head->du_files += count * files;
+    blocks_mark_dirty(get_inode(dir)->block);
+    usage_carry(dir, count * bytes, count * blocks, count * files);
+  }
+}
+
+// Learn which directories name each inode, and take what each inode
+// contributes from the image.
+static void usage_scan()
+{
+  void *ibm = get_inode_bitmap();
+  memset(links, 0, sizeof(links));
+  for (int dir = 0; dir < INODE_COUNT; dir++)
+  {
+    if (!bitmap_get(ibm, dir) || get_inode(dir)->mode != DIRECTORY_MODE)
+    {
+      continue;
+    }
+    dirhead_t *head = usage_head(dir);
+    direntry_t *entries = (direntry_t *)(head + 1);
+    for (int ii = 0; ii < head->num_slots; ii++)
+    {
+      if (entries[ii].present == 1 && strcmp(entries[ii].name, ".") != 0 &&
+          strcmp(entries[ii].name, "..") != 0)
+      {
+        links[entries[ii].inum][dir]++;
+      }
+    }
+  }
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    memset(&contrib[inum], 0, sizeof(usage_t));
+    if (bitmap_get(ibm, inum))
+    {
+      contrib[inum] = usage_current(inum);
+    }
+  }
+}
+
+// Start keeping the totals up to date, recounting them if need be.
+void usage_init(int trusted)
+{
+  superblock_t *sb = get_superblock();
+  usage_active = 1;
+  memset(dirty, 0, sizeof(dirty));
+  if (trusted && sb->usage_valid)
+  {
+    usage_scan();
+    return;
+  }
+
+  // start from nothing, and let every inode contribute afresh
+  void *ibm = get_inode_bitmap();
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    if (bitmap_get(ibm, inum) && get_inode(inum)->mode == DIRECTORY_MODE)
+    {
+      dirhead_t *head = usage_head(inum);
+      head->du_bytes = 0;
+      head->du_blocks = 0;
+      head->du_files = 0;
+      blocks_mark_dirty(get_inode(inum)->block);
+    }
+  }
+  usage_scan();
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    memset(&contrib[inum], 0, sizeof(usage_t));
+    bitmap_put(dirty, inum, bitmap_get(ibm, inum));
+  }
+  usage_flush();
+  sb->usage_valid = 1;
+  blocks_mark_dirty(0);
+  printf("+ usage_init() -> recounted\n");
+}
+
+// Record that an entry naming inum was added to dir.
+void usage_link(int dir, int inum)
+{
+  if (!usage_active)
+  {
+    return;
+  }
+  links[inum][dir]++;
+  dirhead_t *head = usage_head(dir);
+  head->du_bytes += contrib[inum].bytes;
+  head->du_blocks += contrib[inum].blocks;
+  head->du_files += contrib[inum].files;
+  usage_carry(dir, contrib[inum].bytes, contrib[inum].blocks,
+              contrib[inum].files);
+  // a new inode has contributed nothing yet
+  bitmap_put(dirty, inum, 1);
+}
+
+// Record that an entry naming inum was removed from dir.
+void usage_unlink(int dir, int inum)
+{
+  if (!usage_active)
+  {
+    return;
+  }
+  links[inum][dir]--;
+  dirhead_t *head = usage_head(dir);
+  head->du_bytes -= contrib[inum].bytes;
+  head->du_blocks -= contrib[inum].blocks;
+  head->du_files -= contrib[inum].files;
+  usage_carry(dir, -contrib[inum].bytes, -contrib[inum].blocks,
+              -contrib[inum].files);
+}
+
+// Record that the size or blocks of a file may have changed.
+void usage_dirty(int inum)
+{
+  if (usage_active)
+  {
+    bitmap_put(dirty, inum, 1);
+  }
+}
+
+// Forget an inode that is being freed.
+void usage_forget(int inum)
+{
+  memset(&contrib[inum], 0, sizeof(usage_t));
+  bitmap_put(dirty, inum, 0);
+}
+
+// Carry the changes of every marked file up the directories above it.
+void usage_flush()
+{
+  if (!usage_active)
+  {
+    return;
+  }
+  for (int inum = 0; inum < INODE_COUNT; inum++)
+  {
+    if (!bitmap_get(dirty, inum))
+    {
+      continue;
+    }
+    bitmap_put(dirty, inum, 0);
+    usage_t now = usage_current(inum);
+    usage_carry(inum, now.bytes - contrib[inum].bytes,
+                now.blocks - contrib[inum].blocks,
+                now.files - contrib[inum].files);
+  }
+}
+
+// Get the totals beneath a directory, or the usage of a file itself.
+int usage_get(int inum, struct nufs_usage *out)
+{
+  superblock_t *sb = get_superblock();
+  if (!usage_active && (!sb->usage_valid || sb->state != SUPER_CLEAN))
+  {
+    return -ENODATA;
+  }
+  usage_flush();
+  usage_t now = usage_current(inum);
+  if (get_inode(inum)->mode == DIRECTORY_MODE)
+  {
+    // what is beneath it, leaving out the directory itself
+    now.blocks--;
+    now.files--;
+  }
+  out->bytes = now.bytes;
+  out->blocks = now.blocks;
+  out->files = now.files;
+  return 0;
+}
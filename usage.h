@@ -0,0 +1,76 @@
+/**
+ * @file usage.h
+ *
+ * Recursive directory usage: every directory header carries the bytes,
+ * blocks and entries beneath it, so finding how much a tree holds does not
+ * mean walking it.
+ *
+ * Adding and removing directory entries updates the totals up the parent
+ * chain on the spot. Files whose size or blocks change are only marked, and
+ * their changes are carried up the chain in one go by usage_flush. A file
+ * with several links counts once under each of them, as with du -l.
+ *
+ * The totals are written back with the directory blocks. After a crash, or
+ * in images made before they were kept, they are recounted at mount.
+ */
+#ifndef USAGE_H
+#define USAGE_H
+
+#include "nufs_ioctl.h"
+
+/**
+ * Start keeping the totals up to date, learning which directories name
+ * each inode, and recount them if they cannot be trusted.
+ *
+ * @param trusted 0 if the image was not unmounted cleanly.
+ */
+void usage_init(int trusted);
+
+/**
+ * Record that a directory entry naming inum was added to directory dir.
+ *
+ * @param dir Inode number of the directory.
+ * @param inum Inode number the entry names.
+ */
+void usage_link(int dir, int inum);
+
+/**
+ * Record that a directory entry naming inum was removed from directory dir.
+ *
+ * @param dir Inode number of the directory.
+ * @param inum Inode number the entry named.
+ */
+void usage_unlink(int dir, int inum);
+
+/**
+ * Record that the size or blocks of a file may have changed.
+ *
+ * @param inum Inode number of the file.
+ */
+void usage_dirty(int inum);
+
+/**
+ * Forget an inode that is being freed.
+ *
+ * @param inum Inode number.
+ */
+void usage_forget(int inum);
+
+/**
+ * Carry the changes of every file marked with usage_dirty up to the
+ * directories above it.
+ */
+void usage_flush();
+
+/**
+ * Get the totals beneath a directory, or the usage of a file itself.
+ *
+ * @param inum Inode number.
+ * @param out Totals to fill in.
+ *
+ * @return 0 on success, -ENODATA if the totals are out of date and cannot
+ * be recounted (a read-only mount).
+ */
+int usage_get(int inum, struct nufs_usage *out);
+
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file xxh64.c
+ *
+ * XXH64, after the reference implementation: four lanes of 8 bytes while 32
+ * bytes are left, then the rest, then a final mix.
+ */
+#include <string.h>
+
+#include "xxh64.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static u_int64_t rotl(u_int64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static u_int64_t read64(const unsigned char *p)
+{
+  u_int64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static u_int32_t read32(const unsigned char *p)
+{
+  u_int32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Mix 8 bytes of input into a lane.
+static u_int64_t xxh64_round(u_int64_t acc, u_int64_t input)
+{
+  acc += input * P2;
+  acc = rotl(acc, 31);
+  return acc * P1;
+}
+
+// Fold a lane into the hash.
+static u_int64_t xxh64_merge(u_int64_t h, u_int64_t lane)
+{
+  h ^= xxh64_round(0, lane);
+  return h * P1 + P4;
+}
+
+// Compute the XXH64 of a buffer.
+u_int64_t xxh64(const void *buf, size_t len, u_int64_t seed)
+{
+  const unsigned char *p = buf;
+  const unsigned char *end = p + len;
+  u_int64_t h;
+
+  if (len >= 32)
+  {
+    u_int64_t v1 = seed + P1 + P2;
+    u_int64_t v2 = seed + P2;
+    u_int64_t v3 = seed;
+    u_int64_t v4 = seed - P1;
+    for (; p + 32 <= end; p += 32)
+    {
+      v1 = xxh64_round(v1, read64(p));
+      v2 = xxh64_round(v2, read64(p + 8));
+      v3 = xxh64_round(v3, read64(p + 16));
+      v4 = xxh64_round(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+  }
+  else
+  {
+    h = seed + P5;
+  }
+  h += len;
+
+  for (; p + 8 <= end; p += 8)
+  {
+    h ^= xxh64_round(0, read64(p));
+    h = rotl(h, 27) * P1 + P4;
+  }
+  if (p + 4 <= end)
+  {
+    h ^= (u_int64_t)read32(p) * P1;
+    h = rotl(h, 23) * P2 + P3;
+    p += 4;
+  }
+  for (; p < end; p++)
+  {
+    h ^= *p * P5;
+    h = rotl(h, 11) * P1;
+  }
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
@@ -0,0 +1,24 @@
+/**
+ * @file xxh64.h
+ *
+ * XXH64, the 64-bit xxHash: a fast non-cryptographic hash, for fingerprinting
+ * blocks. Matches the reference implementation on little-endian hosts.
+ */
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Compute the XXH64 of a buffer.
+ *
+ * @param buf Data to hash.
+ * @param len Length of the data in bytes.
+ * @param seed Seed, 0 for the usual hash.
+ *
+ * @return The hash.
+ */
+u_int64_t xxh64(const void *buf, size_t len, u_int64_t seed);
+
+#endif